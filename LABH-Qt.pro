@@ -202,6 +202,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/chainparams.h \
     src/chainparamsseeds.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
     src/coincontrol.h \
     src/sync.h \
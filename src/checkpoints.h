@@ -8,8 +8,12 @@
 #include "net.h"
 #include "util.h"
 
+#include <boost/unordered_map.hpp>
+
 class uint256;
 class CBlockIndex;
+struct BlockHasher;
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
  * They are updated every release or three.
@@ -23,7 +27,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     const CBlockIndex* AutoSelectSyncCheckpoint();
     bool CheckSync(int nHeight);
@@ -237,6 +237,70 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint256& nStakeModifie
     return true;
 }
 
+CStakeKernelHasher::CStakeKernelHasher(const uint256& nStakeModifier, unsigned int nBits, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout)
+{
+    // Preimage is nStakeModifier(32) txPrev.nTime(4) prevout.hash(32) prevout.n(4) nTimeTx(4),
+    // laid out as CDataStream would serialize it
+    unsigned char pchPrefix[64];
+    memcpy(pchPrefix, &nStakeModifier, 32);
+    memcpy(pchPrefix + 32, &nTimeTxPrev, 4);
+    memcpy(pchPrefix + 36, &prevout.hash, 28);
+    memcpy(pchTail, (const unsigned char*)&prevout.hash + 28, 4);
+    memcpy(pchTail + 4, &prevout.n, 4);
+    memset(pchTail + 8, 0, 4);
+
+    SHA256_Init(&ctxPrefix);
+    SHA256_Update(&ctxPrefix, pchPrefix, sizeof(pchPrefix));
+
+    // Weighted target, following CBigNum::SetCompact() and operator*
+    unsigned int nSize = nBits >> 24;
+    uint64_t nMantissa = nBits & 0x007fffff;
+    if (nSize <= 3)
+        nMantissa >>= 8 * (3 - nSize);
+    bool fNegativeBits = (nBits & 0x00800000) != 0;
+    fTargetNegative = nMantissa != 0 && nValueIn != 0 && fNegativeBits != (nValueIn < 0);
+    uint64_t nValueAbs = nValueIn < 0 ? -(uint64_t)nValueIn : nValueIn;
+
+    // 23 bit mantissa times 64 bit value, in two 32 bit halves
+    bnTarget = arith_uint256(nMantissa * (nValueAbs >> 32));
+    bnTarget <<= 32;
+    bnTarget += arith_uint256(nMantissa * (nValueAbs & 0xffffffff));
+
+    fTargetOverflow = false;
+    if (nSize > 3)
+    {
+        arith_uint256 bnProduct = bnTarget;
+        bnTarget <<= 8 * (nSize - 3);
+        arith_uint256 bnCheck = bnTarget;
+        bnCheck >>= 8 * (nSize - 3);
+        fTargetOverflow = (bnCheck != bnProduct);
+    }
+}
+
+uint256 CStakeKernelHasher::GetHash(unsigned int nTimeTx) const
+{
+    unsigned char pchTailTx[sizeof(pchTail)];
+    memcpy(pchTailTx, pchTail, 8);
+    memcpy(pchTailTx + 8, &nTimeTx, 4);
+
+    SHA256_CTX ctx = ctxPrefix;
+    uint256 hash1;
+    SHA256_Update(&ctx, pchTailTx, sizeof(pchTailTx));
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
+}
+
+bool CStakeKernelHasher::CheckHash(const uint256& hashProofOfStake) const
+{
+    if (fTargetNegative)
+        return false;
+    if (fTargetOverflow)
+        return true; // weighted target exceeds any 256 bit hash
+    return !(UintToArith256(hashProofOfStake) > bnTarget);
+}
+
 // LABH kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -259,34 +323,22 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint256& nStakeModifie
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHashV2() : nTime violation");
 
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // min age requirement
         return error("CheckStakeKernelHashV2() : min age violation");
 
-    // Base target
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-
-    // Weighted target
-    CAmount nValueIn = txPrev.vout[prevout.n].nValue;
-    CBigNum bnWeight = CBigNum(nValueIn);
-    bnTarget *= bnWeight;
-
-    targetProofOfStake = bnTarget.getuint256();
-
     uint256 nStakeModifier = pindexPrev->nStakeModifier;
     int nStakeModifierHeight = pindexPrev->nHeight;
     int64_t nStakeModifierTime = pindexPrev->nTime;
 
     // Calculate hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier;
-    ss << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
+    CStakeKernelHasher hasher(nStakeModifier, nBits, nTimeTxPrev, nValueIn, prevout);
+    hashProofOfStake = hasher.GetHash(nTimeTx);
+    targetProofOfStake = hasher.GetTarget();
 
     if (fPrintProofOfStake)
     {
@@ -296,12 +348,12 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=%s nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier.ToString(),
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnTarget)
+    if (!hasher.CheckHash(hashProofOfStake))
         return false;
 
     if (fDebug && !fPrintProofOfStake)
@@ -312,7 +364,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=%s nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier.ToString(),
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -321,7 +373,12 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
 
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    return CheckStakeKernelHashV2(pindexPrev, nBits, nTimeBlockFrom, nTimeTxPrev, nValueIn, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
 }
 
 // Check kernel hash target and coinstake signature
@@ -393,3 +450,28 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 
     return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CStakeCandidate& candidate)
+{
+    CStakeKernelHasher hasher(pindexPrev->nStakeModifier, nBits, candidate.nTimeTx, candidate.nValue, candidate.prevout);
+    return CheckKernel(pindexPrev, nTime, candidate, hasher);
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, int64_t nTime, const CStakeCandidate& candidate, const CStakeKernelHasher& hasher)
+{
+    // The candidate must still be confirmed in the chain we are staking on
+    if (!candidate.pindexFrom || !candidate.pindexFrom->IsInMainChain() || candidate.nHeight > pindexPrev->nHeight)
+        return false;
+
+    if (candidate.nTimeBlock + nStakeMinAge > nTime)
+        return false; // only count coins meeting min age requirement
+
+    // Equivalent of IsConfirmedInNPrevBlocks() on the block height
+    if (pindexPrev->nHeight - candidate.nHeight < nStakeMinConfirmations - 1)
+        return false;
+
+    if (nTime < candidate.nTimeTx)
+        return false;
+
+    return hasher.CheckHash(hasher.GetHash(nTime));
+}
@@ -4,8 +4,11 @@
 #ifndef PPCOIN_KERNEL_H
 #define PPCOIN_KERNEL_H
 
+#include "arith_uint256.h"
 #include "main.h"
 
+#include <openssl/sha.h>
+
 // To decrease granularity of timestamp
 // Supposed to be 2^n-1
 static const int STAKE_TIMESTAMP_MASK = 15;
@@ -25,6 +28,10 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+// Check whether stake kernel meets hash target, using only values already in memory
+// Sets hashProofOfStake on success return
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
@@ -40,4 +47,66 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+/** A stakeable output together with everything the kernel protocol needs
+ * to know about it, so a kernel search can run without reading the
+ * transaction database or block files.
+ */
+class CStakeCandidate
+{
+public:
+    COutPoint prevout;
+    CAmount nValue;
+    unsigned int nTimeTx;     // txPrev.nTime
+    unsigned int nTimeBlock;  // time of the block containing txPrev
+    int nHeight;              // height of the block containing txPrev
+    const CBlockIndex* pindexFrom;
+
+    CStakeCandidate()
+    {
+        nValue = 0;
+        nTimeTx = 0;
+        nTimeBlock = 0;
+        nHeight = -1;
+        pindexFrom = NULL;
+    }
+
+    CStakeCandidate(const COutPoint& prevoutIn, CAmount nValueIn, unsigned int nTimeTxIn, const CBlockIndex* pindexFromIn)
+    {
+        prevout = prevoutIn;
+        nValue = nValueIn;
+        nTimeTx = nTimeTxIn;
+        nTimeBlock = pindexFromIn->nTime;
+        nHeight = pindexFromIn->nHeight;
+        pindexFrom = pindexFromIn;
+    }
+};
+
+/** Kernel hash evaluator for a single stake candidate.
+ * The first 64 bytes of the kernel preimage (modifier, txPrev.nTime and most
+ * of the prevout hash) do not depend on the probed timestamp, so their
+ * SHA256 midstate is computed once; the weighted target is kept as a fixed
+ * width integer instead of a CBigNum.
+ */
+class CStakeKernelHasher
+{
+private:
+    SHA256_CTX ctxPrefix;
+    unsigned char pchTail[12]; // prevout.hash tail, prevout.n, nTimeTx
+    arith_uint256 bnTarget;
+    bool fTargetOverflow;
+    bool fTargetNegative;
+
+public:
+    CStakeKernelHasher(const uint256& nStakeModifier, unsigned int nBits, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout);
+
+    uint256 GetHash(unsigned int nTimeTx) const;
+    bool CheckHash(const uint256& hashProofOfStake) const;
+    // Weighted target truncated to 256 bits, as CBigNum::getuint256() would
+    uint256 GetTarget() const { return ArithToUint256(bnTarget); }
+};
+
+// Same as above, but evaluated purely from a cached stake candidate
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CStakeCandidate& candidate);
+bool CheckKernel(CBlockIndex* pindexPrev, int64_t nTime, const CStakeCandidate& candidate, const CStakeKernelHasher& hasher);
+
 #endif // PPCOIN_KERNEL_H
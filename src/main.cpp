@@ -6,10 +6,12 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -36,7 +38,12 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+std::atomic<uint64_t> nTxHashesComputed(0);
+
+BlockMap mapBlockIndex;
+BlockPosMap mapBlockPos;
+CBlockIndexArena blockIndexArena;
+CChain chainActive;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 48);
@@ -59,6 +66,7 @@ int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
 
 struct COrphanBlock {
     uint256 hashBlock;
@@ -92,7 +100,7 @@ struct CMainSignals {
     boost::signals2::signal<void (const CTransaction &, const CBlock *, bool)> SyncTransaction;
     // Notifies listeners of an erased transaction (currently disabled, requires transaction replacement).
     boost::signals2::signal<void (const uint256 &)> EraseTransaction;
-    // Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible).
+    // Notifies listeners of an updated transaction without new data (a coinbase potentially becoming visible, or a transaction leaving the memory pool).
     boost::signals2::signal<void (const uint256 &)> UpdatedTransaction;
     // Notifies listeners of a new active block chain.
     boost::signals2::signal<void (const CBlockLocator &)> SetBestChain;
@@ -238,6 +246,148 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 // CTransaction and CTxIndex
 //
 
+/** Confirmed transactions by their position in the block files.  The bytes at
+ * a position never change, so entries need no invalidation; the least
+ * recently used ones are dropped once the cache outgrows -txcachesizemb.
+ * Entries are shared and never modified, so a hit only copies a pointer
+ * under the lock.
+ */
+class CTxCache
+{
+private:
+    typedef boost::shared_ptr<const CTransaction> TxRef;
+    typedef std::list<std::pair<uint64_t, TxRef> > EntryList;
+
+    EntryList lEntries; // most recently used first
+    boost::unordered_map<uint64_t, EntryList::iterator> mapEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+    CCriticalSection cs;
+
+    static uint64_t GetKey(const CDiskTxPos& pos)
+    {
+        return ((uint64_t)pos.nFile << 32) | pos.nTxPos;
+    }
+
+    static size_t GetUsage(const CTransaction& tx)
+    {
+        return sizeof(CTransaction) + tx.vin.size() * sizeof(CTxIn) + tx.vout.size() * sizeof(CTxOut) +
+            ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    }
+
+public:
+    CTxCache() : nBytes(0), nHits(0), nMisses(0)
+    {
+        nMaxBytes = (size_t)std::max((int64_t)0, GetArg("-txcachesizemb", DEFAULT_TXCACHE_SIZE_MB)) << 20;
+    }
+
+    bool Get(const CDiskTxPos& pos, CTransaction& tx)
+    {
+        TxRef ptx;
+        {
+            LOCK(cs);
+            boost::unordered_map<uint64_t, EntryList::iterator>::iterator mi = mapEntries.find(GetKey(pos));
+            if (mi == mapEntries.end())
+            {
+                nMisses++;
+                return false;
+            }
+            lEntries.splice(lEntries.begin(), lEntries, mi->second);
+            ptx = mi->second->second;
+            nHits++;
+        }
+        tx = *ptx;
+        return true;
+    }
+
+    void Set(const CDiskTxPos& pos, const CTransaction& tx)
+    {
+        size_t nUsage = GetUsage(tx);
+        if (nUsage > nMaxBytes)
+            return;
+
+        uint64_t nKey = GetKey(pos);
+        TxRef ptx(new CTransaction(tx));
+
+        // Dropped entries are released after the lock, where the last reference may go
+        EntryList lDropped;
+        {
+            LOCK(cs);
+            if (mapEntries.count(nKey))
+                return;
+            lEntries.push_front(std::make_pair(nKey, ptx));
+            mapEntries[nKey] = lEntries.begin();
+            nBytes += nUsage;
+            while (nBytes > nMaxBytes)
+            {
+                nBytes -= GetUsage(*lEntries.back().second);
+                mapEntries.erase(lEntries.back().first);
+                lDropped.splice(lDropped.begin(), lEntries, --lEntries.end());
+            }
+        }
+    }
+
+    void GetStats(CTxCacheStats& stats)
+    {
+        LOCK(cs);
+        stats.nSizeBytes = nBytes;
+        stats.nMaxBytes = nMaxBytes;
+        stats.nEntries = mapEntries.size();
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+    }
+};
+
+static CTxCache& GetTxCache()
+{
+    static CTxCache txCache;
+    return txCache;
+}
+
+void AddToTxCache(const CDiskTxPos& pos, const CTransaction& tx)
+{
+    GetTxCache().Set(pos, tx);
+}
+
+void GetTxCacheStats(CTxCacheStats& stats)
+{
+    GetTxCache().GetStats(stats);
+}
+
+bool CTransaction::ReadFromDisk(CDiskTxPos pos, FILE** pfileRet)
+{
+    if (!pfileRet && GetTxCache().Get(pos, *this))
+        return true;
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+
+    // Read transaction
+    if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+        return error("CTransaction::ReadFromDisk() : fseek failed");
+
+    try {
+        filein >> *this;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Return file pointer
+    if (pfileRet)
+    {
+        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+            return error("CTransaction::ReadFromDisk() : second fseek failed");
+        *pfileRet = filein.release();
+    }
+    else
+        GetTxCache().Set(pos, *this);
+    return true;
+}
+
 bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet)
 {
     SetNull();
@@ -273,27 +423,9 @@ bool IsStandardTx(const CTransaction& tx, string& reason)
         return false;
     }
 
-    // Treat non-final transactions as non-standard to prevent a specific type
-    // of double-spend attack, as well as DoS attacks. (if the transaction
-    // can't be mined, the attacker isn't expending resources broadcasting it)
-    // Basically we don't want to propagate transactions that can't be included in
-    // the next block.
-    //
-    // However, IsFinalTx() is confusing... Without arguments, it uses
-    // chainActive.Height() to evaluate nLockTime; when a block is accepted, chainActive.Height()
-    // is set to the value of nHeight in the block. However, when IsFinalTx()
-    // is called within CBlock::AcceptBlock(), the height of the block *being*
-    // evaluated is what is used. Thus if we want to know if a transaction can
-    // be part of the *next* block, we need to call IsFinalTx() with one more
-    // than chainActive.Height().
-    //
-    // Timestamps on the other hand don't get any special treatment, because we
-    // can't know what timestamp the next block will have, and there aren't
-    // timestamp applications where it matters.
-    if (!IsFinalTx(tx, nBestHeight + 1)) {
-        reason = "non-final";
-        return false;
-    }
+    // Finality depends on the chain height, so it is checked by
+    // AcceptToMemoryPool under cs_main rather than here
+
     // nTime has different purpose from nLockTime but can be used in similar attacks
     if (tx.nTime > FutureDrift(GetAdjustedTime())) {
         reason = "time-too-new";
@@ -477,25 +609,76 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const MapPrevTx& inputs)
     return nSigOps;
 }
 
-bool CTransaction::lIIII(int Illll)const{CTransaction lllII=CTransaction(
-nVersion,nTime,vin,vout,nLockTime);uint256 lIIlI=(0x948+6862-0x2416);int lllIl=
-(0x77+345-0x1d0);int IIlII=-(0x5b8+1997-0xd84);if(!IlIII(Illll))return true;
-for(int IllII=(0x1338+3674-0x2192);IllII<(0x1a7f+566-0x1c51);IllII++){if(lllII.
-IsCoinStake()){if(!GetTransaction(lllII.vin[(0x45b+2127-0xcaa)].prevout.hash,
-lllII,lIIlI)){LogPrint("\x73\x74\x61\x6b\x65",
-"\x25\x73\x28\x29\x3a\x20\x63\x6f\x75\x6c\x64\x20\x6e\x6f\x74\x20\x72\x65\x74\x72\x65\x69\x76\x65\x20\x70\x72\x65\x76\x69\x6f\x75\x73\x20\x74\x78" "\n"
-,__func__);return false;}if(mapBlockIndex.count(lIIlI)==(0x7ea+7947-0x26f5)){
-LogPrint("\x73\x74\x61\x6b\x65",
-"\x25\x73\x28\x29\x3a\x20\x68\x61\x73\x68\x3d\x25\x73\x20\x62\x6c\x6f\x63\x6b\x20\x6e\x6f\x74\x20\x66\x6f\x75\x6e\x64" "\n"
-,__func__,lIIlI.ToString());return false;}CBlockIndex*IIllI=mapBlockIndex[lIIlI]
-;LogPrint("\x73\x74\x61\x6b\x65",
-"\x25\x73\x28\x29\x3a\x20\x74\x78\x3d\x25\x73\x20\x62\x6c\x6f\x63\x6b\x3d\x25\x64\x20\x73\x75\x70\x65\x72\x62\x6c\x6f\x63\x6b\x3d\x25\x62\x20\x68\x61\x73\x68\x3d\x25\x73\x20\x69\x73\x50\x6f\x53\x3d\x25\x62" "\n"
-,__func__,lllII.GetHash().ToString(),IIllI->nHeight,IlIII(IIllI->nHeight),lIIlI.
-ToString(),lllII.IsCoinStake());if(!IlIII(IIllI->nHeight))lllIl++;else if(
-Illll>(0xe23+5927-0x254a)&&IIlII==-(0x2010+300-0x213b)&&IlIII(IIllI->nHeight))
-{IIlII=llIII(IIllI->nHeight);break;}}}if(Illll>(0x2135+853-0x248a)&&llIII(
-Illll)==IIlII){return false;}return lllIl>=Params().MinStakingBeforeSuperblock
-()?true:false;}
+bool GetStakeLineage(CTxDB& txdb, const CTransaction& tx, CStakeLineage& lineage, int nDepth)
+{
+    lineage.SetNull();
+    if (!tx.IsCoinStake() || nDepth >= STAKE_LINEAGE_MAX_DEPTH)
+        return true;
+
+    // Coinstakes connected since the lineage index exists are found directly
+    uint256 hashPrev = tx.vin[0].prevout.hash;
+    if (txdb.ReadStakeLineage(hashPrev, lineage))
+        return true;
+
+    // Otherwise walk up the ancestry through the block files
+    CTransaction txPrev;
+    CTxIndex txindex;
+    if (!txdb.ReadDiskTx(hashPrev, txPrev, txindex))
+    {
+        LogPrint("stake", "%s(): could not retrieve previous tx %s\n", __func__, hashPrev.ToString());
+        return false;
+    }
+    CBlockIndex* pindexPrev = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindexPrev)
+    {
+        LogPrint("stake", "%s(): block of %s not found\n", __func__, hashPrev.ToString());
+        return false;
+    }
+    int nHeightPrev = pindexPrev->nHeight;
+    if (IlIII(nHeightPrev))
+    {
+        lineage = CStakeLineage(0, llIII(nHeightPrev));
+        return true;
+    }
+
+    CStakeLineage lineagePrev;
+    if (!GetStakeLineage(txdb, txPrev, lineagePrev, nDepth + 1))
+        return false;
+    lineage = lineagePrev.Next();
+    return true;
+}
+
+bool GetConnectedStakeLineage(CTxDB& txdb, const CTransaction& tx, int nHeight, CStakeLineage& lineage)
+{
+    if (IlIII(nHeight))
+    {
+        lineage = CStakeLineage(0, llIII(nHeight));
+        return true;
+    }
+    if (!GetStakeLineage(txdb, tx, lineage))
+        return false;
+    lineage = lineage.Next();
+    return true;
+}
+
+bool CheckStakeLineage(const CStakeLineage& lineage, int nHeight)
+{
+    if (nHeight > 0 && llIII(nHeight) == lineage.nSuperblockBucket)
+        return false;
+    return lineage.nStakes >= Params().MinStakingBeforeSuperblock();
+}
+
+bool CTransaction::lIIII(int nHeight) const
+{
+    if (!IlIII(nHeight))
+        return true;
+
+    CTxDB txdb("r");
+    CStakeLineage lineage;
+    if (!GetStakeLineage(txdb, *this, lineage))
+        return false;
+    return CheckStakeLineage(lineage, nHeight);
+}
 
 int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
 {
@@ -532,7 +715,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -620,12 +803,14 @@ CAmount GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
     return nMinFee;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs)
-{
-    AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
+// A script that passes the standard flags passes the mandatory ones, so
+// AcceptToMemoryPool evaluates every script once, and ConnectInputs only
+// retries with the mandatory flags to classify a failure.
+static_assert((STANDARD_SCRIPT_VERIFY_FLAGS & MANDATORY_SCRIPT_VERIFY_FLAGS) == MANDATORY_SCRIPT_VERIFY_FLAGS,
+              "standard script flags must include the mandatory ones");
 
+bool PrevalidateTransaction(const CTransaction& tx)
+{
     if (!tx.CheckTransaction())
         return error("AcceptToMemoryPool : CheckTransaction failed");
 
@@ -643,6 +828,38 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
         return error("AcceptToMemoryPool : nonstandard transaction: %s",
                      reason);
 
+    return true;
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fPrevalidated)
+{
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    if (!fPrevalidated && !PrevalidateTransaction(tx))
+        return false;
+
+    // Treat non-final transactions as non-standard to prevent a specific type
+    // of double-spend attack, as well as DoS attacks. (if the transaction
+    // can't be mined, the attacker isn't expending resources broadcasting it)
+    // Basically we don't want to propagate transactions that can't be included in
+    // the next block.
+    //
+    // However, IsFinalTx() is confusing... Without arguments, it uses
+    // chainActive.Height() to evaluate nLockTime; when a block is accepted, chainActive.Height()
+    // is set to the value of nHeight in the block. However, when IsFinalTx()
+    // is called within CBlock::AcceptBlock(), the height of the block *being*
+    // evaluated is what is used. Thus if we want to know if a transaction can
+    // be part of the *next* block, we need to call IsFinalTx() with one more
+    // than chainActive.Height().
+    //
+    // Timestamps on the other hand don't get any special treatment, because we
+    // can't know what timestamp the next block will have, and there aren't
+    // timestamp applications where it matters.
+    if (!TestNet() && !IsFinalTx(tx, nBestHeight + 1))
+        return error("AcceptToMemoryPool : nonstandard transaction: non-final");
+
     // is it already in the memory pool?
     uint256 hash = tx.GetHash();
     if (pool.exists(hash))
@@ -662,6 +879,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
     }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -739,23 +957,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
             return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString());
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, nBurnCoins, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS))
-        {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
-        }
+        // Remember what block assembly needs to know, so it does not have to fetch inputs again
+        vector<CAmount> vInputValues;
+        vInputValues.reserve(tx.vin.size());
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vInputValues.push_back(tx.GetOutputFor(txin, mapInputs).nValue);
+        entry = CTxMemPoolEntry(nFees, nSize, nSigOps, GetTime(), vInputValues);
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, tx, entry);
 
     SyncWithWallets(tx, NULL);
 
@@ -775,7 +986,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -846,15 +1057,8 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    CBlockIndex* pindex = FindBlockByPos(pos.nFile, pos.nBlockPos);
     if (!pindex || !pindex->IsInMainChain())
         return 0;
     return 1 + nBestHeight - pindex->nHeight;
@@ -875,9 +1079,15 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
         CTxIndex txindex;
         if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
         {
-            CBlock block;
-            if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                hashBlock = block.GetHash();
+            CBlockIndex* pindex = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+            if (pindex)
+                hashBlock = pindex->GetBlockHash();
+            else
+            {
+                CBlock block;
+                if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                    hashBlock = block.GetHash();
+            }
             return true;
         }
     }
@@ -896,22 +1106,31 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
+}
+
+CBlockIndex* FindBlockByPos(unsigned int nFile, unsigned int nBlockPos)
+{
+    BlockPosMap::iterator mi = mapBlockPos.find(BlockPosKey(nFile, nBlockPos));
+    if (mi == mapBlockPos.end())
+        return NULL;
+    return mi->second;
+}
+
+CBlockIndex *CChain::SetTip(CBlockIndex *pindex)
+{
+    if (pindex == NULL) {
+        vChain.clear();
+        return NULL;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex) {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+    return pindex;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -921,10 +1140,19 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
         *this = pindex->GetBlockHeader();
         return true;
     }
-    if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
+    // Blocks in the index had their proof-of-work checked when they were
+    // accepted, and hashProof keeps the result. Comparing the header fields
+    // with the index catches a wrong or damaged read just as well as
+    // rehashing, without paying for scrypt again.
+    if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions, false))
         return false;
-    if (GetHash() != pindex->GetBlockHash())
-        return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
+    if (nVersion != pindex->nVersion ||
+        hashPrevBlock != (pindex->pprev ? pindex->pprev->GetBlockHash() : 0) ||
+        hashMerkleRoot != pindex->hashMerkleRoot ||
+        nTime != pindex->nTime ||
+        nBits != pindex->nBits ||
+        nNonce != pindex->nNonce)
+        return error("CBlock::ReadFromDisk() : block header doesn't match index");
     return true;
 }
 
@@ -1183,7 +1411,9 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
 
 bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth)
 {
-    for (const CBlockIndex* pindex = pindexFrom; pindex && pindexFrom->nHeight - pindex->nHeight < nMaxDepth; pindex = pindex->pprev)
+    // Walk back through pprev only until we reach the active chain (pindexFrom may be on a branch being connected)
+    const CBlockIndex* pindex = pindexFrom;
+    for (; pindex && !chainActive.Contains(pindex) && pindexFrom->nHeight - pindex->nHeight < nMaxDepth; pindex = pindex->pprev)
     {
         if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
         {
@@ -1191,6 +1421,18 @@ bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindex
             return true;
         }
     }
+    if (!pindex)
+        return false;
+
+    for (int nHeight = pindex->nHeight; nHeight >= 0 && pindexFrom->nHeight - nHeight < nMaxDepth; nHeight--)
+    {
+        const CBlockIndex* pindexChain = chainActive[nHeight];
+        if (pindexChain->nBlockPos == txindex.pos.nBlockPos && pindexChain->nFile == txindex.pos.nFile)
+        {
+            nActualDepth = pindexFrom->nHeight - nHeight;
+            return true;
+        }
+    }
 
     return false;
 }
@@ -1337,8 +1579,8 @@ CAmount CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
-bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, CAmount &nBurnCoins, bool fBlock, bool fMiner, unsigned int flags)
+bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx& inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
+    const CBlockIndex* pindexBlock, CAmount &nBurnCoins, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1401,7 +1643,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
+                CScriptCheck check(txPrev, *this, i, flags, 0);
+                if (pvChecks)
+                {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                }
+                else if (!check())
                 {
                     if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                         // Check whether the failure was caused by a
@@ -1475,6 +1723,9 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!vtx[i].DisconnectInputs(txdb))
             return false;
 
+    if (IsProofOfStake() && !txdb.EraseStakeLineage(vtx[1].GetHash()))
+        return error("DisconnectBlock() : EraseStakeLineage failed");
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1492,6 +1743,20 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType);
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck()
+{
+    RenameThread("labh-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1515,6 +1780,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     CAmount nFees = 0;
     CAmount nValueIn = 0;
@@ -1578,17 +1845,26 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, nBurnCoins, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, nBurnCoins, true, false, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+
+        // Its outputs are the likeliest to be spent next
+        if (!fJustCheck)
+            AddToTxCache(posThisTx, tx);
     }
 
     if (nBurnCoins > 0 && fDebug) {
         LogPrintf("ConnectBlock() : burning coins %s\n", FormatMoney(nBurnCoins));
     }
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     if (IsProofOfWork())
     {
         CAmount nReward = GetProofOfWorkReward(nFees);
@@ -1601,8 +1877,15 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (IsProofOfStake())
     {
         // LABH: Check address's staking, can't stake more than MinStakingBeforeSuperblock
-        if (IlIII(pindex->pprev->nHeight+1) && !vtx[1].lIIII(pindex->pprev->nHeight+1))
-            return error("ConnectBlock() : %s unable to stake on superblock for coinstake", vtx[1].GetHash().ToString());
+        // Read through a fresh CTxDB, as this rule always has: transactions connected
+        // earlier in the same reorganize (still in txdb's batch) are not visible to it
+        if (IlIII(pindex->pprev->nHeight+1))
+        {
+            CTxDB txdbLineage("r");
+            CStakeLineage lineage;
+            if (!(GetStakeLineage(txdbLineage, vtx[1], lineage) && CheckStakeLineage(lineage, pindex->pprev->nHeight+1)))
+                return error("ConnectBlock() : %s unable to stake on superblock for coinstake", vtx[1].GetHash().ToString());
+        }
 
         // ppcoin: coin stake tx earns reward instead of paying fee
         CAmount nCoinAge;
@@ -1631,6 +1914,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // LABH: index the stake lineage of the new coinstake for the superblock rule.
+    // Unlike the check above this reads through txdb, so it follows the chain
+    // being connected rather than the one a reorganize is disconnecting.
+    CStakeLineage lineage;
+    if (IsProofOfStake() && GetConnectedStakeLineage(txdb, vtx[1], pindex->nHeight, lineage))
+    {
+        if (!txdb.WriteStakeLineage(vtx[1].GetHash(), lineage))
+            return error("ConnectBlock() : WriteStakeLineage failed");
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1732,16 +2025,20 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         AcceptToMemoryPool(mempool, tx, false, NULL);
 
     // Delete redundant memory transactions that are in the connected branch
+    list<CTransaction> removed;
     BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
+        mempool.remove(tx, removed);
+        mempool.removeConflicts(tx, removed);
     }
+    BOOST_FOREACH(const CTransaction& tx, removed)
+        g_signals.UpdatedTransaction(tx.GetHash());
 
     LogPrintf("REORGANIZE: done\n");
 
@@ -1766,10 +2063,14 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
 
     // Delete redundant memory transactions
+    list<CTransaction> removed;
     BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+        mempool.remove(tx, removed);
+    BOOST_FOREACH(const CTransaction& tx, removed)
+        g_signals.UpdatedTransaction(tx.GetHash());
 
     return true;
 }
@@ -1787,6 +2088,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1850,7 +2152,6 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -1947,6 +2248,8 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, CAmoun
     return true;
 }
 
+bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS);
+
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof)
 {
     AssertLockHeld(cs_main);
@@ -1957,11 +2260,11 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (blockIndexArena.Allocate()) CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    mapBlockPos[BlockPosKey(nFile, nBlockPos)] = pindexNew;
+    pindexNew->nBlockSigStatus = IsCanonicalBlockSignature(this, true) ? CBlockIndex::BLOCKSIG_CANONICAL : CBlockIndex::BLOCKSIG_NEEDS_LOW_S;
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -1987,7 +2290,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->nStakeModifier = ComputeStakeModifierV2(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2111,7 +2414,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2511,6 +2814,30 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CBlockIndex* pindex)
+{
+    // The block is preceded by the message start and its serialized size
+    if (pindex->nBlockPos < sizeof(unsigned int))
+        return false;
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - sizeof(unsigned int), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadRawBlockFromDisk() : OpenBlockFile failed");
+
+    try {
+        unsigned int nSize;
+        filein >> nSize;
+        if (nSize > MAX_SIZE)
+            return error("ReadRawBlockFromDisk() : block size %u too large", nSize);
+        ssBlock.resize(nSize);
+        if (nSize > 0)
+            filein.read(&ssBlock[0], nSize);
+    }
+    catch (std::exception &e) {
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -2579,7 +2906,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2706,6 +3033,7 @@ bool LoadExternalBlockFile(FILE* fileIn)
         }
     }
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    LogPrintf("Transaction hashes: %u computed\n", (uint64_t)nTxHashesComputed);
     return nLoaded > 0;
 }
 
@@ -2863,19 +3191,39 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
+                    CBlockIndex* pindex = (*mi).second;
 
-                    // previous versions could accept sigs with high s
-                    if (!IsCanonicalBlockSignature(&block, true)) {
-                        bool ret = EnsureLowS(block.vchBlockSig);
-                        assert(ret);
+                    // Blocks with a canonical signature are sent straight from the block file
+                    bool fSent = false;
+                    if (pindex->nBlockSigStatus == CBlockIndex::BLOCKSIG_CANONICAL)
+                    {
+                        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                        if (ReadRawBlockFromDisk(ssBlock, pindex))
+                        {
+                            pfrom->PushMessage("block", ssBlock);
+                            fSent = true;
+                        }
                     }
 
-                    pfrom->PushMessage("block", block);
+                    if (!fSent)
+                    {
+                        CBlock block;
+                        bool fRead = block.ReadFromDisk(pindex);
+
+                        // previous versions could accept sigs with high s
+                        if (!IsCanonicalBlockSignature(&block, true)) {
+                            bool ret = EnsureLowS(block.vchBlockSig);
+                            assert(ret);
+                            pindex->nBlockSigStatus = CBlockIndex::BLOCKSIG_NEEDS_LOW_S;
+                        }
+                        else if (fRead)
+                            pindex->nBlockSigStatus = CBlockIndex::BLOCKSIG_CANONICAL;
+
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3253,7 +3601,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3289,13 +3637,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Checks that need no chain state are done before taking cs_main;
+        // finality is checked by AcceptToMemoryPool once it is held
+        bool fPrevalid = PrevalidateTransaction(tx);
+        bool fKnown = fPrevalid && mempool.exists(inv.hash);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
 
         mapAlreadyAskedFor.erase(inv);
 
-        if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs))
+        if (fPrevalid && !fKnown && AcceptToMemoryPool(mempool, tx, true, &fMissingInputs, true))
         {
             RelayTransaction(tx, inv.hash);
             vWorkQueue.push_back(inv.hash);
@@ -3641,7 +3994,11 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; itDone++)
+            pfrom->RecycleRecvBuffer(itDone->vRecv);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
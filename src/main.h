@@ -13,8 +13,13 @@
 #include "script.h"
 #include "scrypt.h"
 
+#include <atomic>
 #include <limits>
 #include <list>
+#include <new>
+#include <type_traits>
+
+#include <boost/unordered_map.hpp>
 
 class CBlock;
 class CBlockIndex;
@@ -49,6 +54,12 @@ static const CAmount MIN_RELAY_TX_FEE = MIN_TX_FEE;
 /** No amount larger than this (in satoshi) is valid */
 static const CAmount MAX_MONEY = 50000000000 * COIN; // 50 Billions CAP
 inline bool MoneyRange(CAmount nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Number of stake generations followed by the superblock staking rule */
+static const int STAKE_LINEAGE_MAX_DEPTH = 100;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 
@@ -161,10 +172,22 @@ inline unsigned int GetTargetSpacing(int nHeight) {
     return 120;
 }
 
+/** Block hashes are already uniformly distributed, so their low bits make a good hash */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.GetLow64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+/** Block index entries by the block's position in the block files, see BlockPosKey() */
+typedef boost::unordered_map<uint64_t, CBlockIndex*> BlockPosMap;
+inline uint64_t BlockPosKey(unsigned int nFile, unsigned int nBlockPos) { return ((uint64_t)nFile << 32) | nBlockPos; }
+
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
+extern BlockPosMap mapBlockPos;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -186,6 +209,7 @@ extern bool fReindex;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
+extern int nScriptCheckThreads;
 
 // Settings
 extern bool fUseFastIndex;
@@ -194,7 +218,9 @@ extern unsigned int nDerivationMethodIndex;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
+class CDiskTxPos;
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -220,10 +246,14 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
+/** Read a block exactly as stored in the block files, without deserializing it */
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CBlockIndex* pindex);
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Find the block stored at the given position, without reading or hashing its header */
+CBlockIndex* FindBlockByPos(unsigned int nFile, unsigned int nBlockPos);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
@@ -238,14 +268,36 @@ bool IsInitialBlockDownload();
 bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+
+/** -txcachesizemb default */
+static const int64_t DEFAULT_TXCACHE_SIZE_MB = 8;
+
+struct CTxCacheStats
+{
+    uint64_t nSizeBytes;
+    uint64_t nMaxBytes;
+    uint64_t nEntries;
+    uint64_t nHits;
+    uint64_t nMisses;
+};
+
+/** Confirmed transactions kept in memory by their block file position */
+void AddToTxCache(const CDiskTxPos& pos, const CTransaction& tx);
+void GetTxCacheStats(CTxCacheStats& stats);
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStake(CWallet *pwallet);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 
-/** (try to) add transaction to memory pool **/
+/** Checks on a loose transaction that need no chain state, safe without cs_main.
+ * Finality at the next height is left to AcceptToMemoryPool. **/
+bool PrevalidateTransaction(const CTransaction& tx);
+
+/** (try to) add transaction to memory pool; fPrevalidated skips PrevalidateTransaction **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs);
+                        bool* pfMissingInputs, bool fPrevalidated=false);
 
 
 
@@ -313,8 +365,18 @@ typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
 
 CAmount GetMinFee(const CTransaction& tx, unsigned int nBlockSize = 1, enum GetMinFee_mode mode = GMF_BLOCK, unsigned int nBytes = 0);
 
+/** Number of transaction hashes computed. Hashes served from a deserialized
+ * transaction's cache are not counted, to keep GetHash() free of shared writes */
+extern std::atomic<uint64_t> nTxHashesComputed;
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
+ *
+ * A transaction read from a stream is immutable: its hash and serialized size
+ * are computed once, at the end of deserialization.  Code that builds a
+ * transaction (wallet, miner) works on one that was never deserialized, and
+ * code that edits a deserialized copy must call SetMutable() first
+ * (SignSignature() does so itself).
  */
 class CTransaction
 {
@@ -330,24 +392,47 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // Memory only: set by Freeze(), cleared by SetMutable()
+    bool fImmutable;
+    uint256 hashCached;
+    unsigned int nSizeCached;
+
+    void Freeze()
+    {
+        fImmutable = false;
+        nSizeCached = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+        hashCached = SerializeHash(*this);
+        nTxHashesComputed++;
+        fImmutable = true;
+    }
+
+public:
     CTransaction()
     {
         SetNull();
     }
 
     CTransaction(int nVersion, unsigned int nTime, const std::vector<CTxIn>& vin, const std::vector<CTxOut>& vout, unsigned int nLockTime)
-        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0)
+        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0), fImmutable(false), nSizeCached(0)
     {
     }
 
     IMPLEMENT_SERIALIZE
     (
-        READWRITE(this->nVersion);
-        nVersion = this->nVersion;
-        READWRITE(nTime);
-        READWRITE(vin);
-        READWRITE(vout);
-        READWRITE(nLockTime);
+        if (fGetSize && fImmutable)
+            nSerSize = nSizeCached;
+        else
+        {
+            READWRITE(this->nVersion);
+            nVersion = this->nVersion;
+            READWRITE(nTime);
+            READWRITE(vin);
+            READWRITE(vout);
+            READWRITE(nLockTime);
+        }
+        if (fRead)
+            const_cast<CTransaction*>(this)->Freeze();
     )
 
     void SetNull()
@@ -358,6 +443,20 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        SetMutable();
+    }
+
+    /** Drop the cached hash and size before changing a deserialized transaction */
+    void SetMutable()
+    {
+        fImmutable = false;
+        hashCached = 0;
+        nSizeCached = 0;
+    }
+
+    bool IsImmutable() const
+    {
+        return fImmutable;
     }
 
     bool IsNull() const
@@ -367,6 +466,9 @@ public:
 
     uint256 GetHash() const
     {
+        if (fImmutable)
+            return hashCached;
+        nTxHashesComputed++;
         return SerializeHash(*this);
     }
 
@@ -406,32 +508,9 @@ public:
      */
     CAmount GetValueIn(const MapPrevTx& mapInputs) const;
 
-    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
-    {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
-        return true;
-    }
+    /** Read the transaction at pos, from the confirmed transaction cache when
+        it is there.  With pfileRet the block file is always opened and returned. */
+    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL);
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -493,12 +572,14 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
-    bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
+    bool ConnectInputs(CTxDB& txdb, MapPrevTx& inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
                        const CBlockIndex* pindexBlock, CAmount &nBurnCoins, bool fBlock,
-                       bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, CAmount& nCoinAge) const;
 
@@ -550,6 +631,34 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason);
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
+/** Closure representing one script verification
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 
 
 /** A transaction with a merkle branch linking it to the block chain. */
@@ -668,6 +777,63 @@ public:
 
 
 
+/** Stake ancestry of a transaction, as followed by the superblock staking
+ * rule: starting at the transaction and moving to the one spent by vin[0]
+ * for as long as the current one is a coinstake, nStakes counts the
+ * transactions found in non-superblock blocks (at most
+ * STAKE_LINEAGE_MAX_DEPTH) and nSuperblockBucket is the bucket of the
+ * superblock that ended the walk, or -1.
+ */
+class CStakeLineage
+{
+public:
+    int nStakes;
+    int nSuperblockBucket;
+
+    CStakeLineage()
+    {
+        SetNull();
+    }
+
+    CStakeLineage(int nStakesIn, int nSuperblockBucketIn)
+    {
+        nStakes = nStakesIn;
+        nSuperblockBucket = nSuperblockBucketIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nStakes);
+        READWRITE(nSuperblockBucket);
+    )
+
+    void SetNull()
+    {
+        nStakes = 0;
+        nSuperblockBucket = -1;
+    }
+
+    // Lineage of a coinstake in a non-superblock block whose kernel input
+    // has this lineage
+    CStakeLineage Next() const
+    {
+        if (nStakes >= STAKE_LINEAGE_MAX_DEPTH - 1)
+            return CStakeLineage(STAKE_LINEAGE_MAX_DEPTH, -1);
+        return CStakeLineage(nStakes + 1, nSuperblockBucket);
+    }
+};
+
+/** Get the lineage of the output staked by a coinstake, using the stake lineage index where possible */
+bool GetStakeLineage(CTxDB& txdb, const CTransaction& tx, CStakeLineage& lineage, int nDepth = 0);
+/** Get the lineage of a coinstake connected at nHeight, as stored in the stake lineage index */
+bool GetConnectedStakeLineage(CTxDB& txdb, const CTransaction& tx, int nHeight, CStakeLineage& lineage);
+/** Whether a coinstake with the given lineage may stake a superblock at nHeight */
+bool CheckStakeLineage(const CStakeLineage& lineage, int nHeight);
+
+
+
+
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -881,7 +1047,7 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
+    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true, bool fCheckHeader=true)
     {
         SetNull();
 
@@ -901,7 +1067,7 @@ public:
         }
 
         // Check the header
-        if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
+        if (fReadTransactions && fCheckHeader && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -995,6 +1161,15 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
+    // Whether the block signature on disk can be sent as is (memory only)
+    enum
+    {
+        BLOCKSIG_UNKNOWN = 0,
+        BLOCKSIG_CANONICAL,
+        BLOCKSIG_NEEDS_LOW_S,
+    };
+    int nBlockSigStatus;
+
     CBlockIndex()
     {
         phashBlock = NULL;
@@ -1017,6 +1192,7 @@ public:
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
+        nBlockSigStatus = BLOCKSIG_UNKNOWN;
     }
 
     CBlockIndex(unsigned int nFileIn, unsigned int nBlockPosIn, CBlock& block)
@@ -1050,6 +1226,7 @@ public:
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
+        nBlockSigStatus = BLOCKSIG_UNKNOWN;
     }
 
     CBlock GetBlockHeader() const
@@ -1267,6 +1444,88 @@ public:
 
 
 
+/** Bump allocator for block index entries.
+ * Entries are never freed while the node runs, so they are carved out of
+ * large contiguous chunks instead of being allocated one by one.
+ * Callers must hold cs_main (or be loading the block index at startup).
+ */
+class CBlockIndexArena
+{
+private:
+    typedef std::aligned_storage<sizeof(CBlockIndex), alignof(CBlockIndex)>::type Slot;
+    static const size_t CHUNK_SIZE = 16384;
+
+    std::vector<Slot*> vChunks;
+    size_t nUsed;
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+
+    /** Raw storage for one CBlockIndex, to be constructed with placement new */
+    void* Allocate()
+    {
+        if (nUsed == CHUNK_SIZE)
+        {
+            vChunks.push_back(new Slot[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    size_t size() const { return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_SIZE + nUsed; }
+};
+
+extern CBlockIndexArena blockIndexArena;
+
+/** An in-memory indexed chain of blocks, kept in step with the pnext links of the best chain. */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the index entry for the genesis block of this chain, or NULL if none. */
+    CBlockIndex *Genesis() const {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** Returns the index entry for the tip of this chain, or NULL if none. */
+    CBlockIndex *Tip() const {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Returns the index entry at a particular height in this chain, or NULL if no such height exists. */
+    CBlockIndex *operator[](int nHeight) const {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    /** Efficiently check whether a block is present in this chain. */
+    bool Contains(const CBlockIndex *pindex) const {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Find the successor of a block in this chain, or NULL if the given index is not found or is the tip. */
+    CBlockIndex *Next(const CBlockIndex *pindex) const {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        else
+            return NULL;
+    }
+
+    /** Return the maximal height in the chain. Is equal to chain.Tip() ? chain.Tip()->nHeight : -1. */
+    int Height() const {
+        return vChain.size() - 1;
+    }
+
+    /** Set/initialize a chain with a given tip. Returns the forking point. */
+    CBlockIndex *SetTip(CBlockIndex *pindex);
+};
+
+/** The currently-connected chain of blocks. */
+extern CChain chainActive;
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -1288,7 +1547,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1318,14 +1577,20 @@ public:
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
+        vHave.reserve(32);
         int nStep = 1;
         while (pindex)
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back; jump directly once on the active chain
+            if (chainActive.Contains(pindex))
+                pindex = chainActive[pindex->nHeight - nStep];
+            else
+            {
+                for (int i = 0; pindex && i < nStep; i++)
+                    pindex = pindex->pprev;
+            }
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1339,7 +1604,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1358,7 +1623,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1374,7 +1639,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -53,36 +53,190 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
+bool CBlockAssemblyView::ReadTxIndex(const uint256& hash, CTxIndex& txindex)
 {
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dFeePerKb;
+    return ptxdb->ReadTxIndex(hash, txindex);
+}
 
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dFeePerKb = 0;
-    }
-};
+bool CBlockAssemblyView::ReadTx(const CTxIndex& txindex, CTransaction& tx)
+{
+    return tx.ReadFromDisk(txindex.pos);
+}
 
+// Coinbase and coinstake outputs must be nCoinbaseMaturity blocks deep below
+// the block being assembled. Only transactions confirmed that recently, or in
+// a block we cannot find, are read.
+bool CBlockAssemblyView::IsMature(const CTxIndex& txindex, int nHeight)
+{
+    CBlockIndex* pindex = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (pindex && (nHeight - 1) - pindex->nHeight >= nCoinbaseMaturity)
+        return true;
+
+    CTransaction txPrev;
+    if (!ReadTx(txindex, txPrev))
+        return false;
+    return !txPrev.IsCoinBase() && !txPrev.IsCoinStake();
+}
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+bool CBlockAssemblyView::ConnectTx(const CTransaction& tx, int nHeight)
+{
+    vector<COutPoint> vSpent;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const COutPoint& prevout = txin.prevout;
+        bool fUnspent;
+        map<uint256, unsigned int>::const_iterator mi = mapBlockOutputs.find(prevout.hash);
+        if (mi != mapBlockOutputs.end())
+            fUnspent = prevout.n < mi->second;
+        else
+        {
+            map<uint256, CTxIndex>::iterator it = mapConfirmed.find(prevout.hash);
+            if (it == mapConfirmed.end())
+            {
+                // a transaction missing from the index is remembered with no outputs
+                it = mapConfirmed.insert(make_pair(prevout.hash, CTxIndex())).first;
+                ReadTxIndex(prevout.hash, it->second);
+            }
+            const CTxIndex& txindex = it->second;
+            fUnspent = prevout.n < txindex.vSpent.size() && txindex.vSpent[prevout.n].IsNull() &&
+                       IsMature(txindex, nHeight);
+        }
 
-// We want to sort transactions by fee, so:
-typedef boost::tuple<double, CTransaction*> TxPriority;
-class TxPriorityCompare
+        if (!fUnspent || !setSpent.insert(prevout).second)
+        {
+            BOOST_FOREACH(const COutPoint& outpoint, vSpent)
+                setSpent.erase(outpoint);
+            return false;
+        }
+        vSpent.push_back(prevout);
+    }
+    mapBlockOutputs[tx.GetHash()] = tx.vout.size();
+    return true;
+}
+
+CAmount AddPoolTransactions(CTxMemPool& pool, CBlock* pblock, CBlockAssemblyView& view, int nHeight, bool fProofOfStake,
+                            unsigned int nBlockMaxSize, unsigned int nBlockMinSize, CAmount nMinTxFee,
+                            uint64_t& nBlockSize, uint64_t& nBlockTx)
 {
-public:
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    AssertLockHeld(pool.cs);
+    CAmount nFees = 0;
+    set<uint256> setAdded;  // pool transactions already in the block
+    set<uint256> setFailed; // pool transactions that cannot go into this block
+    int nBlockSigOps = 100;
+
+    // Walk the pool from the highest ancestor package fee rate down. Each
+    // transaction is added together with those of its unconfirmed ancestors
+    // that are not in the block yet, parents first.
+    vector<const CTxMemPoolEntry*> vPackage;
+    for (set<CTxMemPool::FeeRateKey>::reverse_iterator it = pool.setByAncestorFeeRate.rbegin();
+         it != pool.setByAncestorFeeRate.rend(); ++it)
     {
-        return a.get<0>() < b.get<0>();
+        const uint256& hashTx = it->second;
+        if (setAdded.count(hashTx) || setFailed.count(hashTx))
+            continue;
+
+        pool.GetSortedAncestors(hashTx, vPackage);
+        vPackage.push_back(&pool.mapEntry[hashTx]);
+
+        uint64_t nPackageSize = 0;
+        unsigned int nPackageSigOps = 0;
+        CAmount nPackageFees = 0;
+        bool fPackageFailed = false;
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+        {
+            uint256 hash = pentry->GetTx().GetHash();
+            if (setFailed.count(hash))
+                fPackageFailed = true;
+            if (setAdded.count(hash))
+                continue;
+            nPackageSize += pentry->GetTxSize();
+            nPackageSigOps += pentry->GetSigOps();
+            nPackageFees += pentry->GetFee();
+        }
+        if (fPackageFailed)
+        {
+            setFailed.insert(hashTx);
+            continue;
+        }
+
+        // Size limits
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+            continue;
+
+        // Limits on sigOps:
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        double dFeePerKb = double(nPackageFees) / (double(nPackageSize)/1000.0);
+
+        // Skip free transactions if we're past the minimum block size:
+        if ((dFeePerKb < nMinTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize))
+            continue;
+
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+        {
+            const CTransaction& tx = pentry->GetTx();
+            uint256 hash = tx.GetHash();
+            if (setAdded.count(hash))
+                continue;
+
+            bool fValid = false;
+            do
+            {
+                if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+                    break;
+
+                // Timestamp limit
+                if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+                    break;
+
+                // Transaction fee
+                CAmount nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
+                if (pentry->GetFee() < nMinFee)
+                    break;
+
+                // Connecting shouldn't fail due to dependency on other memory pool transactions
+                // because ancestors always go in before their descendants. Only the
+                // spends and their maturity are checked: the pool verified scripts
+                // and amounts on entry.
+                if (!view.ConnectTx(tx, nHeight))
+                    break;
+                fValid = true;
+            } while (false);
+
+            if (!fValid)
+            {
+                // Nothing spending it can go in either
+                setFailed.insert(hash);
+                setFailed.insert(hashTx);
+                break;
+            }
+
+            // Added
+            pblock->vtx.push_back(tx);
+            setAdded.insert(hash);
+            nBlockSize += pentry->GetTxSize();
+            ++nBlockTx;
+            nBlockSigOps += pentry->GetSigOps();
+            nFees += pentry->GetFee();
+
+            if (fDebug && GetBoolArg("-printpriority", false))
+            {
+                LogPrintf("feeperkb %.1f ancestorfeeperkb %.1f txid %s\n",
+                       pentry->GetFeeRate(), pentry->GetAncestorFeeRate(), hash.ToString());
+            }
+        }
     }
-};
+
+    return nFees;
+}
 
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, CAmount* pFees)
@@ -146,171 +300,12 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, CAmount* pFe
     {
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
+        CBlockAssemblyView view(&txdb);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                CAmount nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb = double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
         uint64_t nBlockSize = 1000;
         uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-
-        TxPriorityCompare comparer;
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dFeePerKb = vecPriority.front().get<0>();
-            CTransaction& tx = *(vecPriority.front().get<1>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
-
-            // Transaction fee
-            CAmount nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
-
-            // Skip free transactions if we're past the minimum block size:
-            if ((dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            CAmount nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CAmount nBurnCoins = 0;
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, nBurnCoins, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority", false))
-            {
-                LogPrintf("feeperkb %.1f txid %s\n",
-                       dFeePerKb, tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        nFees = AddPoolTransactions(mempool, pblock.get(), view, nHeight, fProofOfStake,
+                                    nBlockMaxSize, nBlockMinSize, nMinTxFee, nBlockSize, nBlockTx);
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -336,6 +331,62 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, CAmount* pFe
 }
 
 
+// Last proof-of-stake template and what it was built against
+static CCriticalSection cs_stakeTemplate;
+static CBlock* pstakeTemplate = NULL;
+static CAmount nStakeTemplateFees = 0;
+static CBlockIndex* pindexStakeTemplate = NULL;
+static unsigned int nStakeTemplateTxUpdated = 0;
+static int64_t nStakeTemplateTime = 0;
+static CStakeTemplateStats stakeTemplateStats;
+
+// Rebuild at least this often, to pick up transactions whose timestamps were in the future
+static const int64_t STAKE_TEMPLATE_MAX_AGE = 60;
+
+CBlock* CreateStakeBlock(CReserveKey& reservekey, CAmount* pFees)
+{
+    LOCK(cs_stakeTemplate);
+
+    unsigned int nTxUpdated = mempool.GetTransactionsUpdated();
+    if (pstakeTemplate == NULL || pindexStakeTemplate != pindexBest || nStakeTemplateTxUpdated != nTxUpdated ||
+        GetTime() - nStakeTemplateTime > STAKE_TEMPLATE_MAX_AGE)
+    {
+        CBlockIndex* pindexPrev = pindexBest;
+        int64_t nStart = GetTimeMicros();
+        CAmount nFees = 0;
+        CBlock* pblock = CreateNewBlock(reservekey, true, &nFees);
+        if (!pblock)
+            return NULL;
+        int64_t nElapsed = GetTimeMicros() - nStart;
+
+        delete pstakeTemplate;
+        pstakeTemplate = pblock;
+        nStakeTemplateFees = nFees;
+        pindexStakeTemplate = pindexPrev;
+        nStakeTemplateTxUpdated = nTxUpdated;
+        nStakeTemplateTime = GetTime();
+
+        stakeTemplateStats.nBuilds++;
+        stakeTemplateStats.nLastBuildTime = nElapsed;
+        stakeTemplateStats.nTotalBuildTime += nElapsed;
+        LogPrint("stake", "CreateStakeBlock() : built template with %u transactions in %dus\n", pblock->vtx.size(), nElapsed);
+    }
+    else
+        stakeTemplateStats.nReuses++;
+
+    // SignBlock patches the copy with the coinstake and final timestamp
+    if (pFees)
+        *pFees = nStakeTemplateFees;
+    return new CBlock(*pstakeTemplate);
+}
+
+CStakeTemplateStats GetStakeTemplateStats()
+{
+    LOCK(cs_stakeTemplate);
+    return stakeTemplateStats;
+}
+
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -518,7 +569,7 @@ void ThreadStake(CWallet *pwallet)
         // Create new block
         //
         CAmount nFees;
-        auto_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
+        auto_ptr<CBlock> pblock(CreateStakeBlock(reservekey, &nFees));
         if (!pblock.get())
             return;
 
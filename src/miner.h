@@ -9,9 +9,60 @@
 #include "main.h"
 #include "wallet.h"
 
+class CTxDB;
+
+/** The chain's unspent outputs as block assembly sees them: confirmed outputs
+ *  from the tx index, with the outputs created and spent by the transactions
+ *  already in the new block on top. Nothing is copied per transaction.
+ */
+class CBlockAssemblyView
+{
+public:
+    CBlockAssemblyView(CTxDB* ptxdbIn) : ptxdb(ptxdbIn) {}
+    virtual ~CBlockAssemblyView() {}
+
+    // Spend the inputs of tx and add its outputs, if all its inputs are
+    // unspent and mature in a block at nHeight; otherwise leave the view
+    // as it was
+    bool ConnectTx(const CTransaction& tx, int nHeight);
+
+protected:
+    virtual bool ReadTxIndex(const uint256& hash, CTxIndex& txindex);
+    virtual bool ReadTx(const CTxIndex& txindex, CTransaction& tx);
+
+private:
+    bool IsMature(const CTxIndex& txindex, int nHeight);
+
+    CTxDB* ptxdb;
+    std::map<uint256, CTxIndex> mapConfirmed;        // tx index entries read so far
+    std::map<uint256, unsigned int> mapBlockOutputs; // outputs of the transactions in the block
+    std::set<COutPoint> setSpent;                    // outputs spent by the block
+};
+
+/** Add memory pool transactions to pblock, highest ancestor package fee rate
+ *  first. Inputs are checked against view; scripts were already checked when
+ *  the transactions were accepted to the pool. Returns the fees added. */
+CAmount AddPoolTransactions(CTxMemPool& pool, CBlock* pblock, CBlockAssemblyView& view, int nHeight, bool fProofOfStake,
+                            unsigned int nBlockMaxSize, unsigned int nBlockMinSize, CAmount nMinTxFee,
+                            uint64_t& nBlockSize, uint64_t& nBlockTx);
+
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake=false, CAmount* pFees = 0);
 
+/** Proof-of-stake block template, reused while neither the best chain nor the memory pool has changed */
+CBlock* CreateStakeBlock(CReserveKey& reservekey, CAmount* pFees);
+
+/** Counters of the proof-of-stake block template cache */
+struct CStakeTemplateStats
+{
+    uint64_t nBuilds;
+    uint64_t nReuses;
+    int64_t nLastBuildTime;   // microseconds
+    int64_t nTotalBuildTime;  // microseconds
+};
+
+CStakeTemplateStats GetStakeTemplateStats();
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 
@@ -12,8 +12,18 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
+#include <atomic>
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -405,12 +415,15 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     return NULL;
 }
 
+static void RemoveSocketEvents(CNode* pnode);
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting node %s\n", addrName);
+        RemoveSocketEvents(this);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -507,6 +520,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nMisbehavior);
     X(nSendBytes);
     X(nRecvBytes);
+    {
+        LOCK(cs_recvStats);
+        X(mapRecvStats);
+    }
     stats.fSyncNode = (this == pnodeSync);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -544,7 +561,12 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         // absorb network data
         int handled;
         if (!msg.in_data)
+        {
             handled = msg.readHeader(pch, nBytes);
+
+            if (msg.in_data)
+                GetRecvBuffer(msg);
+        }
         else
             handled = msg.readData(pch, nBytes);
 
@@ -555,12 +577,74 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete())
+        {
             msg.nTime = GetTimeMicros();
+
+            // ProcessMessages drops messages with a bad header; so do the
+            // stats, or a peer could fill them with arbitrary commands
+            if (!msg.hdr.IsValid())
+                continue;
+
+            LOCK(cs_recvStats);
+            std::string strCommand = msg.hdr.GetCommand();
+            if (mapRecvStats.size() >= MAX_RECV_STATS_COMMANDS && !mapRecvStats.count(strCommand))
+                strCommand = "other";
+            CMessageStats& stats = mapRecvStats[strCommand];
+            stats.nMessages++;
+            stats.nBytes += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+            stats.nAllocs += msg.nAllocs;
+        }
     }
 
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+void CNode::GetRecvBuffer(CNetMessage& msg)
+{
+    if (msg.hdr.nMessageSize == 0)
+        return;
+    unsigned int nWant = std::min(msg.hdr.nMessageSize, RECV_CHUNK_SIZE);
+
+    // The smallest pooled buffer that fits, else the largest one
+    std::vector<CSerializeData>::iterator itBest = vRecvPool.end();
+    for (std::vector<CSerializeData>::iterator it = vRecvPool.begin(); it != vRecvPool.end(); it++)
+    {
+        if (itBest == vRecvPool.end())
+            itBest = it;
+        else if (itBest->capacity() < nWant ? it->capacity() > itBest->capacity()
+                                             : it->capacity() >= nWant && it->capacity() < itBest->capacity())
+            itBest = it;
+    }
+    if (itBest != vRecvPool.end())
+    {
+        nRecvPoolBytes -= itBest->capacity();
+        msg.vRecv.swap(*itBest);
+        itBest->swap(vRecvPool.back());
+        vRecvPool.pop_back();
+    }
+
+    if (msg.vRecv.capacity() < nWant)
+    {
+        msg.vRecv.reserve(nWant);
+        msg.nAllocs++;
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::RecycleRecvBuffer(CDataStream& vRecv)
+{
+    // Past the pool's bounds the buffer is freed along with its message
+    size_t nCapacity = vRecv.capacity();
+    if (nCapacity == 0 || vRecvPool.size() >= MAX_RECV_POOL_BUFFERS || nRecvPoolBytes + nCapacity > MAX_RECV_POOL_BYTES)
+        return;
+
+    vRecvPool.push_back(CSerializeData());
+    vRecv.swap(vRecvPool.back());
+    vRecvPool.back().clear();
+    nRecvPoolBytes += vRecvPool.back().capacity();
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -599,7 +683,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + nCopy + RECV_CHUNK_SIZE);
+        if (vRecv.capacity() < nSize)
+            nAllocs++;
+        vRecv.resize(nSize);
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -642,6 +729,8 @@ void SocketSendData(CNode *pnode)
             if (nBytes < 0) {
                 // error
                 int nErr = WSAGetLastError();
+                if (nErr == WSAEWOULDBLOCK)
+                    pnode->fSocketSendReady = false;
                 if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                 {
                     LogPrintf("socket send error %d\n", nErr);
@@ -662,10 +751,382 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+//
+// Socket readiness backends for ThreadSocketHandler
+//
+
+enum NetBackend
+{
+    NET_BACKEND_SELECT,
+    NET_BACKEND_POLL,
+    NET_BACKEND_EPOLL,
+};
+
+static NetBackend nNetBackend = NET_BACKEND_SELECT;
+#ifndef WIN32
+// Self-pipe used to interrupt a wait when other threads queue data to send
+static int hWakePipe[2] = { -1, -1 };
+#endif
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+// Tags for epoll events that do not belong to a node
+static char chEpollListenTag;
+static char chEpollWakeTag;
+#endif
+static std::atomic<bool> fSocketHandlerWaiting(false);
+
+// How long to wait for socket events when there is nothing to do
+static const int SOCKET_WAIT_TIMEOUT = 50; // milliseconds
+// How long to wait when a ready peer's buffers are held by another thread
+static const int SOCKET_BUSY_TIMEOUT = 5; // milliseconds
+
+void WakeSocketHandler()
+{
+#ifndef WIN32
+    if (hWakePipe[1] != -1 && fSocketHandlerWaiting.exchange(false))
+    {
+        char c = 0;
+        if (write(hWakePipe[1], &c, 1) < 0) {}
+    }
+#endif
+}
+
+// Stop reporting events for a node's socket. This must happen before the
+// socket is closed: a child forked by runCommand() inherits the descriptor,
+// and while it stays open the kernel keeps the registration alive and would
+// report events for a CNode that may already be deleted.
+static void RemoveSocketEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (pnode->fSocketRegistered.exchange(false))
+    {
+        struct epoll_event event; // ignored, but kernels before 2.6.9 require it
+        if (epoll_ctl(hEpoll, EPOLL_CTL_DEL, pnode->hSocket, &event) != 0)
+            LogPrintf("socket epoll_ctl delete error %d\n", errno);
+    }
+#endif
+}
+
+static void DrainWakePipe()
+{
+#ifndef WIN32
+    char buf[64];
+    while (read(hWakePipe[0], buf, sizeof(buf)) > 0) {}
+#endif
+}
+
+static void InitSocketEvents()
+{
+#ifdef WIN32
+    nNetBackend = NET_BACKEND_SELECT;
+#else
+#ifdef USE_EPOLL
+    string strBackend = GetArg("-netbackend", "epoll");
+#else
+    string strBackend = GetArg("-netbackend", "poll");
+#endif
+
+    nNetBackend = NET_BACKEND_POLL;
+    if (strBackend == "select")
+        nNetBackend = NET_BACKEND_SELECT;
+#ifdef USE_EPOLL
+    else if (strBackend == "epoll")
+        nNetBackend = NET_BACKEND_EPOLL;
+#endif
+    else if (strBackend != "poll")
+        LogPrintf("Unknown -netbackend=%s, using poll\n", strBackend);
+
+    if (nNetBackend != NET_BACKEND_SELECT && hWakePipe[0] == -1)
+    {
+        if (pipe(hWakePipe) != 0)
+        {
+            LogPrintf("InitSocketEvents() : pipe failed, errno %d\n", errno);
+            hWakePipe[0] = hWakePipe[1] = -1;
+        }
+        else
+        {
+            fcntl(hWakePipe[0], F_SETFL, fcntl(hWakePipe[0], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(hWakePipe[1], F_SETFL, fcntl(hWakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+        }
+    }
+
+#ifdef USE_EPOLL
+    if (nNetBackend == NET_BACKEND_EPOLL && hEpoll == -1)
+    {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1)
+        {
+            LogPrintf("InitSocketEvents() : epoll_create1 failed, errno %d, using poll\n", errno);
+            nNetBackend = NET_BACKEND_POLL;
+        }
+        else
+        {
+            // Listening sockets and the wake pipe are level-triggered
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &chEpollListenTag;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+                    LogPrintf("InitSocketEvents() : epoll_ctl failed for listening socket, errno %d\n", errno);
+            if (hWakePipe[0] != -1)
+            {
+                event.data.ptr = &chEpollWakeTag;
+                epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakePipe[0], &event);
+            }
+        }
+    }
+#endif
+#endif
+
+    LogPrintf("Using %s for network events\n",
+        nNetBackend == NET_BACKEND_EPOLL ? "epoll" : (nNetBackend == NET_BACKEND_POLL ? "poll" : "select"));
+}
+
+// Wait for activity on the listening sockets and peers, marking the ready
+// peers in fSocketRecvReady/fSocketSendReady. Returns whether a listening
+// socket may have a connection to accept.
+static bool WaitForSocketEvents(const vector<CNode*>& vNodesIn)
+{
+    bool fListenReady = false;
+
+#ifdef USE_EPOLL
+    if (nNetBackend == NET_BACKEND_EPOLL)
+    {
+        // Sockets are registered once, edge-triggered for both directions,
+        // and removed by CloseSocketDisconnect() before they are closed.
+        int nTimeout = SOCKET_WAIT_TIMEOUT;
+        fSocketHandlerWaiting = true;
+        BOOST_FOREACH(CNode* pnode, vNodesIn)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!pnode->fSocketRegistered)
+            {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.ptr = pnode;
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0)
+                {
+                    LogPrintf("socket epoll_ctl error %d\n", errno);
+                    pnode->CloseSocketDisconnect();
+                    continue;
+                }
+                pnode->fSocketRegistered = true;
+            }
+            // Readiness left over from the last round does not need a new
+            // event. Only skip the wait if that work can be done right away;
+            // while another thread holds the buffers, back off briefly.
+            bool fPending = false, fBusy = false;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend)
+                    fBusy = pnode->fSocketRecvReady;
+                else if (!pnode->vSendMsg.empty())
+                    fPending = pnode->fSocketSendReady;
+                else if (pnode->fSocketRecvReady)
+                {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    fPending = lockRecv;
+                    fBusy = !lockRecv;
+                }
+            }
+            if (fPending)
+                nTimeout = 0;
+            else if (fBusy)
+                nTimeout = min(nTimeout, SOCKET_BUSY_TIMEOUT);
+        }
+
+        struct epoll_event events[256];
+        int nEvents = epoll_wait(hEpoll, events, 256, nTimeout);
+        fSocketHandlerWaiting = false;
+        boost::this_thread::interruption_point();
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %d\n", errno);
+                MilliSleep(SOCKET_WAIT_TIMEOUT);
+            }
+            return false;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (events[i].data.ptr == &chEpollListenTag)
+                fListenReady = true;
+            else if (events[i].data.ptr == &chEpollWakeTag)
+                DrainWakePipe();
+            else
+            {
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                    pnode->fSocketRecvReady = true;
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                {
+                    LOCK(pnode->cs_vSend);
+                    pnode->fSocketSendReady = true;
+                }
+            }
+        }
+        return fListenReady;
+    }
+#endif
+
+#ifndef WIN32
+    if (nNetBackend == NET_BACKEND_POLL)
+    {
+        vector<struct pollfd> vpollfd;
+        vector<CNode*> vpollnode;
+        vpollfd.reserve(vhListenSocket.size() + vNodesIn.size() + 1);
+        vpollnode.reserve(vhListenSocket.size() + vNodesIn.size() + 1);
+
+        struct pollfd pfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+            pfd.fd = hListenSocket;
+            vpollfd.push_back(pfd);
+            vpollnode.push_back(NULL);
+        }
+        if (hWakePipe[0] != -1) {
+            pfd.fd = hWakePipe[0];
+            vpollfd.push_back(pfd);
+            vpollnode.push_back(NULL);
+        }
+        unsigned int nNodesBegin = vpollfd.size();
+
+        fSocketHandlerWaiting = true;
+        BOOST_FOREACH(CNode* pnode, vNodesIn)
+        {
+            pnode->fSocketRecvReady = false;
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                pnode->fSocketSendReady = false;
+                // do not read, if draining write queue
+                pfd.fd = pnode->hSocket;
+                pfd.events = pnode->vSendMsg.empty() ? POLLIN : POLLOUT;
+                vpollfd.push_back(pfd);
+                vpollnode.push_back(pnode);
+            }
+        }
+
+        int nPoll = poll(&vpollfd[0], vpollfd.size(), SOCKET_WAIT_TIMEOUT);
+        fSocketHandlerWaiting = false;
+        boost::this_thread::interruption_point();
+        if (nPoll < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket poll error %d\n", errno);
+                MilliSleep(SOCKET_WAIT_TIMEOUT);
+            }
+            return false;
+        }
+
+        for (unsigned int i = 0; i < vpollfd.size(); i++)
+        {
+            if (vpollfd[i].revents == 0)
+                continue;
+            if (i < nNodesBegin)
+            {
+                if (vpollfd[i].fd == hWakePipe[0])
+                    DrainWakePipe();
+                else
+                    fListenReady = true;
+                continue;
+            }
+            CNode* pnode = vpollnode[i];
+            if (vpollfd[i].revents & (POLLIN | POLLERR | POLLHUP))
+                pnode->fSocketRecvReady = true;
+            if (vpollfd[i].revents & POLLOUT)
+            {
+                LOCK(pnode->cs_vSend);
+                pnode->fSocketSendReady = true;
+            }
+        }
+        return fListenReady;
+    }
+#endif
+
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_WAIT_TIMEOUT * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesIn)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                // do not read, if draining write queue
+                if (!pnode->vSendMsg.empty())
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                else
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+                FD_SET(pnode->hSocket, &fdsetError);
+                hSocketMax = max(hSocketMax, pnode->hSocket);
+                have_fds = true;
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %d\n", nErr);
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+            fListenReady = true;
+    BOOST_FOREACH(CNode* pnode, vNodesIn)
+    {
+        pnode->fSocketRecvReady = false;
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            pnode->fSocketRecvReady = true;
+        LOCK(pnode->cs_vSend);
+        pnode->fSocketSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+    }
+    return fListenReady;
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
 
+    InitSocketEvents();
+
     while (true)
     {
         //
@@ -735,111 +1196,67 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
-                    }
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
+        bool fListenReady = WaitForSocketEvents(vNodesCopy);
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (fListenReady)
         {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            {
+                if (hListenSocket == INVALID_SOCKET)
+                    continue;
 
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
+                struct sockaddr_storage sockaddr;
+                socklen_t len = sizeof(sockaddr);
+                SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+                CAddress addr;
+                int nInbound = 0;
 
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
+                if (hSocket != INVALID_SOCKET)
+                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+                        LogPrintf("Warning: Unknown socket family\n");
 
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
                 {
                     LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
+                    BOOST_FOREACH(CNode* pnode, vNodes)
+                        if (pnode->fInbound)
+                            nInbound++;
+                }
+
+                if (hSocket == INVALID_SOCKET)
+                {
+                    int nErr = WSAGetLastError();
+                    if (nErr != WSAEWOULDBLOCK)
+                        LogPrintf("socket error accept failed: %d\n", nErr);
+                }
+                else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+                {
+                    closesocket(hSocket);
+                }
+                else if (CNode::IsBanned(addr))
+                {
+                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+                    closesocket(hSocket);
+                }
+                else
+                {
+                    LogPrint("net", "accepted connection %s\n", addr.ToString());
+                    CNode* pnode = new CNode(hSocket, addr, "", true);
+                    pnode->AddRef();
+                    {
+                        LOCK(cs_vNodes);
+                        vNodes.push_back(pnode);
+                    }
                 }
             }
         }
@@ -848,13 +1265,6 @@ void ThreadSocketHandler()
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
@@ -864,7 +1274,14 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fRecvReady = pnode->fSocketRecvReady;
+            if (fRecvReady && nNetBackend == NET_BACKEND_EPOLL)
+            {
+                // do not read, if draining write queue
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                fRecvReady = lockSend && pnode->vSendMsg.empty();
+            }
+            if (fRecvReady)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -888,6 +1305,7 @@ void ThreadSocketHandler()
                         }
                         else if (nBytes == 0)
                         {
+                            pnode->fSocketRecvReady = false;
                             // socket closed gracefully
                             if (!pnode->fDisconnect)
                                 LogPrint("net", "socket closed\n");
@@ -897,6 +1315,8 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketRecvReady = false;
                             if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
@@ -913,10 +1333,9 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend && pnode->fSocketSendReady && !pnode->vSendMsg.empty())
                     SocketSendData(pnode);
             }
 
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include <atomic>
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
@@ -31,6 +32,13 @@ extern int nBestHeight;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Payload buffers kept per node for reuse by later messages, and their total capacity */
+static const unsigned int MAX_RECV_POOL_BUFFERS = 8;
+static const unsigned int MAX_RECV_POOL_BYTES = 2 * 1024 * 1024;
+/** Initial allocation for a message payload; larger messages grow as their data arrives */
+static const unsigned int RECV_CHUNK_SIZE = 256 * 1024;
+/** Distinct commands counted per node; the rest are counted as "other" */
+static const unsigned int MAX_RECV_STATS_COMMANDS = 64;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -48,6 +56,7 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeSocketHandler();
 
 // Signals for message handling
 struct CNodeSignals
@@ -109,6 +118,17 @@ extern CCriticalSection cs_vAddedNodes;
 
 
 
+/** Messages of one command received from a peer */
+class CMessageStats
+{
+public:
+    uint64_t nMessages;
+    uint64_t nBytes;
+    uint64_t nAllocs; // payload buffer allocations, zero when a pooled buffer was big enough
+
+    CMessageStats() : nMessages(0), nBytes(0), nAllocs(0) {}
+};
+
 class CNodeStats
 {
 public:
@@ -129,6 +149,7 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    std::map<std::string, CMessageStats> mapRecvStats;
 };
 
 
@@ -146,6 +167,7 @@ public:
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
+    unsigned int nAllocs;           // times vRecv had to grow its allocation
 
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
@@ -153,6 +175,7 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nAllocs = 0;
     }
 
     bool complete() const
@@ -190,9 +213,19 @@ public:
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Socket readiness as last reported to ThreadSocketHandler. With the
+    // edge-triggered epoll backend these stay set until a recv/send would block.
+    std::atomic<bool> fSocketRecvReady;
+    bool fSocketSendReady; // protected by cs_vSend
+    std::atomic<bool> fSocketRegistered;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    std::vector<CSerializeData> vRecvPool; // payload buffers of processed messages, protected by cs_vRecvMsg
+    size_t nRecvPoolBytes;
+    std::map<std::string, CMessageStats> mapRecvStats;
+    CCriticalSection cs_recvStats; // never held while taking another lock
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -259,6 +292,7 @@ public:
         nLastRecv = 0;
         nSendBytes = 0;
         nRecvBytes = 0;
+        nRecvPoolBytes = 0;
         nTimeConnected = GetTime();
         nTimeOffset = 0;
         addr = addrIn;
@@ -274,6 +308,9 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fSocketRecvReady = false;
+        fSocketSendReady = false;
+        fSocketRegistered = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -332,6 +369,12 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // Pooled payload buffers: GetRecvBuffer sizes a message's vRecv once its
+    // header is read, RecycleRecvBuffer takes it back after processing.
+    // requires LOCK(cs_vRecvMsg)
+    void GetRecvBuffer(CNetMessage& msg);
+    void RecycleRecvBuffer(CDataStream& vRecv);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -459,6 +502,10 @@ public:
         if (it == vSendMsg.begin())
             SocketSendData(this);
 
+        // Whatever is left is for the socket thread
+        if (!vSendMsg.empty())
+            WakeSocketHandler();
+
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
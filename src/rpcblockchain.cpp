@@ -73,11 +73,22 @@ double GetPoWMHashPS()
 
 double GetPoSKernelPS()
 {
+    // Only depends on the best chain, so the last result holds until the tip moves
+    static CCriticalSection cs_cache;
+    static const CBlockIndex* pindexCached = NULL;
+    static double dCached = 0;
+    CBlockIndex* pindexTip = pindexBest;
+    {
+        LOCK(cs_cache);
+        if (pindexCached && pindexCached == pindexTip)
+            return dCached;
+    }
+
     int nPoSInterval = 72;
     double dStakeKernelsTriedAvg = 0;
     int nStakesHandled = 0, nStakesTime = 0;
 
-    CBlockIndex* pindex = pindexBest;;
+    CBlockIndex* pindex = pindexTip;
     CBlockIndex* pindexPrevStake = NULL;
 
     while (pindex && nStakesHandled < nPoSInterval)
@@ -103,6 +114,11 @@ double GetPoSKernelPS()
 
     result *= STAKE_TIMESTAMP_MASK + 1;
 
+    {
+        LOCK(cs_cache);
+        pindexCached = pindexTip;
+        dCached = result;
+    }
     return result;
 }
 
@@ -211,6 +227,19 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+void streamgetrawmempool(const Array& params, CRPCStreamWriter& writer)
+{
+    if (params.size() != 0)
+        getrawmempool(params, true);
+
+    vector<uint256> vtxid;
+    mempool.queryHashes(vtxid);
+
+    BOOST_FOREACH(const uint256& hash, vtxid)
+        writer.push_back(hash.ToString());
+    writer.Finish();
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -260,13 +289,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = chainActive[nHeight];
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -142,10 +142,30 @@ Value getstakinginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
 
     obj.push_back(Pair("weight", (uint64_t)nWeight));
+    obj.push_back(Pair("stakeable", ValueFromAmount(pwalletMain ? pwalletMain->GetBalances().nStakeable : 0)));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
 
+    CStakeTemplateStats stats = GetStakeTemplateStats();
+    uint64_t nRequests = stats.nBuilds + stats.nReuses;
+    Object templ;
+    templ.push_back(Pair("builds", stats.nBuilds));
+    templ.push_back(Pair("reuses", stats.nReuses));
+    templ.push_back(Pair("reuserate", nRequests ? (double)stats.nReuses / nRequests : 0.0));
+    templ.push_back(Pair("lastbuildtime", stats.nLastBuildTime));
+    templ.push_back(Pair("avgbuildtime", stats.nBuilds ? stats.nTotalBuildTime / (int64_t)stats.nBuilds : (int64_t)0));
+    obj.push_back(Pair("template", templ));
+
+    CStakeSearchStats searchStats = GetStakeSearchStats();
+    Object search;
+    search.push_back(Pair("threads", searchStats.nThreads));
+    search.push_back(Pair("rounds", searchStats.nRounds));
+    search.push_back(Pair("coins", (uint64_t)searchStats.nCoins));
+    search.push_back(Pair("lastroundtime", searchStats.nLastRoundTime));
+    search.push_back(Pair("avgroundtime", searchStats.nRounds ? searchStats.nTotalRoundTime / (int64_t)searchStats.nRounds : (int64_t)0));
+    obj.push_back(Pair("search", search));
+
     return obj;
 }
 
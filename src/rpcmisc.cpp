@@ -37,7 +37,7 @@ Value getinfo(const Array& params, bool fHelp)
     proxyType proxy;
     GetProxy(NET_IPV4, proxy);
 
-    Object obj, diff;
+    Object obj, diff, sigcache, txhashes, txcache;
     obj.push_back(Pair("version",       FormatFullVersion()));
     obj.push_back(Pair("protocolversion",(int)PROTOCOL_VERSION));
 #ifdef ENABLE_WALLET
@@ -59,6 +59,27 @@ Value getinfo(const Array& params, bool fHelp)
     diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
     obj.push_back(Pair("difficulty",    diff));
 
+    CSignatureCacheStats sigcachestats;
+    GetSignatureCacheStats(sigcachestats);
+    sigcache.push_back(Pair("size",       (uint64_t)sigcachestats.nSizeBytes));
+    sigcache.push_back(Pair("hits",       (uint64_t)sigcachestats.nHits));
+    sigcache.push_back(Pair("misses",     (uint64_t)sigcachestats.nMisses));
+    sigcache.push_back(Pair("inserts",    (uint64_t)sigcachestats.nInserts));
+    sigcache.push_back(Pair("evictions",  (uint64_t)sigcachestats.nEvictions));
+    obj.push_back(Pair("sigcache",      sigcache));
+
+    txhashes.push_back(Pair("computed",   (uint64_t)nTxHashesComputed));
+    obj.push_back(Pair("txhashes",      txhashes));
+
+    CTxCacheStats txcachestats;
+    GetTxCacheStats(txcachestats);
+    txcache.push_back(Pair("size",        (uint64_t)txcachestats.nSizeBytes));
+    txcache.push_back(Pair("maxsize",     (uint64_t)txcachestats.nMaxBytes));
+    txcache.push_back(Pair("entries",     (uint64_t)txcachestats.nEntries));
+    txcache.push_back(Pair("hits",        (uint64_t)txcachestats.nHits));
+    txcache.push_back(Pair("misses",      (uint64_t)txcachestats.nMisses));
+    obj.push_back(Pair("txcache",       txcache));
+
     obj.push_back(Pair("testnet",       TestNet()));
 #ifdef ENABLE_WALLET
     if (pwalletMain) {
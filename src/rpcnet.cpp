@@ -96,6 +96,17 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("banscore", stats.nMisbehavior));
         obj.push_back(Pair("syncnode", stats.fSyncNode));
 
+        Object recvcmds;
+        BOOST_FOREACH(const PAIRTYPE(string, CMessageStats)& item, stats.mapRecvStats)
+        {
+            Object cmd;
+            cmd.push_back(Pair("msgs", (uint64_t)item.second.nMessages));
+            cmd.push_back(Pair("bytes", (uint64_t)item.second.nBytes));
+            cmd.push_back(Pair("allocs", (uint64_t)item.second.nAllocs));
+            recvcmds.push_back(Pair(item.first, cmd));
+        }
+        obj.push_back(Pair("recvcmds", recvcmds));
+
         ret.push_back(obj);
     }
 
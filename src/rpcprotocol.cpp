@@ -99,6 +99,21 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         strMsg);
 }
 
+string HTTPChunkedReplyHeader(bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 200 OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: application/json\r\n"
+            "Server: labh-json-rpc/%s\r\n"
+            "\r\n",
+        rfc1123Time(),
+        keepalive ? "keep-alive" : "close",
+        FormatFullVersion());
+}
+
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          string& http_method, string& http_uri)
 {
@@ -174,6 +189,35 @@ int ReadHTTPHeaders(std::basic_istream<char>& stream, map<string, string>& mapHe
     return nLen;
 }
 
+// Body sent with Transfer-Encoding: chunked, at most MAX_SIZE bytes in total
+static bool ReadHTTPChunkedBody(std::basic_istream<char>& stream, string& strMessageRet)
+{
+    while (true)
+    {
+        string str;
+        std::getline(stream, str);
+        if (!stream)
+            return false;
+        // chunk size in hex, optionally followed by extensions
+        char* pend;
+        unsigned long nChunk = strtoul(str.c_str(), &pend, 16);
+        if (pend == str.c_str() || nChunk > MAX_SIZE - strMessageRet.size())
+            return false;
+        if (nChunk == 0)
+            break;
+        size_t nOld = strMessageRet.size();
+        strMessageRet.resize(nOld + nChunk);
+        stream.read(&strMessageRet[nOld], nChunk);
+        std::getline(stream, str); // CRLF after the chunk data
+        if (!stream || !(str.empty() || str == "\r"))
+            return false;
+    }
+
+    // trailer, ended by an empty line
+    map<string, string> mapTrailers;
+    ReadHTTPHeaders(stream, mapTrailers);
+    return true;
+}
 
 int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
                     string>& mapHeadersRet, string& strMessageRet,
@@ -188,7 +232,12 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (boost::iequals(mapHeadersRet["transfer-encoding"], "chunked"))
+    {
+        if (!ReadHTTPChunkedBody(stream, strMessageRet))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
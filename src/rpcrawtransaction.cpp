@@ -89,7 +89,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -141,28 +141,18 @@ Value getrawtransaction(const Array& params, bool fHelp)
 }
 
 #ifdef ENABLE_WALLET
-Value listunspent(const Array& params, bool fHelp)
+static void ParseListUnspentParams(const Array& params, int& nMinDepth, int& nMaxDepth, set<CBitcoinAddress>& setAddress)
 {
-    if (fHelp || params.size() > 3)
-        throw runtime_error(
-            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
-            "Returns array of unspent transaction outputs\n"
-            "with between minconf and maxconf (inclusive) confirmations.\n"
-            "Optionally filtered to only include txouts paid to specified addresses.\n"
-            "Results are an array of Objects, each of which has:\n"
-            "{txid, vout, scriptPubKey, amount, confirmations}");
-
     RPCTypeCheck(params, list_of(int_type)(int_type)(array_type));
 
-    int nMinDepth = 1;
+    nMinDepth = 1;
     if (params.size() > 0)
         nMinDepth = params[0].get_int();
 
-    int nMaxDepth = 9999999;
+    nMaxDepth = 9999999;
     if (params.size() > 1)
         nMaxDepth = params[1].get_int();
 
-    set<CBitcoinAddress> setAddress;
     if (params.size() > 2)
     {
         Array inputs = params[2].get_array();
@@ -176,6 +166,66 @@ Value listunspent(const Array& params, bool fHelp)
            setAddress.insert(address);
         }
     }
+}
+
+// Fills entry and returns true if out passes the listunspent filters
+static bool UnspentToJSON(const COutput& out, int nMinDepth, int nMaxDepth, const set<CBitcoinAddress>& setAddress, Object& entry)
+{
+    if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
+        return false;
+
+    if(setAddress.size())
+    {
+        CTxDestination address;
+        if(!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+            return false;
+
+        if (!setAddress.count(address))
+            return false;
+    }
+
+    CAmount nValue = out.tx->vout[out.i].nValue;
+    const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+    entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
+    entry.push_back(Pair("vout", out.i));
+    CTxDestination address;
+    if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+    {
+        entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
+        if (pwalletMain->mapAddressBook.count(address))
+            entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+    }
+    entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
+    if (pk.IsPayToScriptHash())
+    {
+        CTxDestination address;
+        if (ExtractDestination(pk, address))
+        {
+            const CScriptID& hash = boost::get<CScriptID>(address);
+            CScript redeemScript;
+            if (pwalletMain->GetCScript(hash, redeemScript))
+                entry.push_back(Pair("redeemScript", HexStr(redeemScript.begin(), redeemScript.end())));
+        }
+    }
+    entry.push_back(Pair("amount",ValueFromAmount(nValue)));
+    entry.push_back(Pair("confirmations",out.nDepth));
+    return true;
+}
+
+Value listunspent(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
+            "Returns array of unspent transaction outputs\n"
+            "with between minconf and maxconf (inclusive) confirmations.\n"
+            "Optionally filtered to only include txouts paid to specified addresses.\n"
+            "Results are an array of Objects, each of which has:\n"
+            "{txid, vout, scriptPubKey, amount, confirmations}");
+
+    int nMinDepth, nMaxDepth;
+    set<CBitcoinAddress> setAddress;
+    ParseListUnspentParams(params, nMinDepth, nMaxDepth, setAddress);
 
     Array results;
     vector<COutput> vecOutputs;
@@ -183,49 +233,54 @@ Value listunspent(const Array& params, bool fHelp)
     pwalletMain->AvailableCoins(vecOutputs, false);
     BOOST_FOREACH(const COutput& out, vecOutputs)
     {
-        if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
-            continue;
+        Object entry;
+        if (UnspentToJSON(out, nMinDepth, nMaxDepth, setAddress, entry))
+            results.push_back(entry);
+    }
 
-        if(setAddress.size())
-        {
-            CTxDestination address;
-            if(!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-                continue;
+    return results;
+}
 
-            if (!setAddress.count(address))
-                continue;
-        }
+void streamlistunspent(const Array& params, CRPCStreamWriter& writer)
+{
+    if (params.size() > 3)
+        listunspent(params, true);
 
-        CAmount nValue = out.tx->vout[out.i].nValue;
-        const CScript& pk = out.tx->vout[out.i].scriptPubKey;
-        Object entry;
-        entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
-        entry.push_back(Pair("vout", out.i));
-        CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-        {
-            entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
-        }
-        entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
-        if (pk.IsPayToScriptHash())
+    int nMinDepth, nMaxDepth;
+    set<CBitcoinAddress> setAddress;
+    ParseListUnspentParams(params, nMinDepth, nMaxDepth, setAddress);
+
+    // Outputs are remembered by outpoint, as the wallet may change between batches
+    vector<pair<COutPoint, int> > vOutpoints;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        vector<COutput> vecOutputs;
+        pwalletMain->AvailableCoins(vecOutputs, false);
+        vOutpoints.reserve(vecOutputs.size());
+        BOOST_FOREACH(const COutput& out, vecOutputs)
+            vOutpoints.push_back(make_pair(COutPoint(out.tx->GetHash(), out.i), out.nDepth));
+    }
+
+    static const unsigned int nBatch = 1000;
+    for (unsigned int nStart = 0; nStart < vOutpoints.size(); nStart += nBatch)
+    {
+        Array results;
         {
-            CTxDestination address;
-            if (ExtractDestination(pk, address))
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            for (unsigned int n = nStart; n < vOutpoints.size() && n < nStart + nBatch; n++)
             {
-                const CScriptID& hash = boost::get<CScriptID>(address);
-                CScript redeemScript;
-                if (pwalletMain->GetCScript(hash, redeemScript))
-                    entry.push_back(Pair("redeemScript", HexStr(redeemScript.begin(), redeemScript.end())));
+                map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(vOutpoints[n].first.hash);
+                if (mi == pwalletMain->mapWallet.end())
+                    continue;
+                Object entry;
+                if (UnspentToJSON(COutput(&(*mi).second, vOutpoints[n].first.n, vOutpoints[n].second), nMinDepth, nMaxDepth, setAddress, entry))
+                    results.push_back(entry);
             }
         }
-        entry.push_back(Pair("amount",ValueFromAmount(nValue)));
-        entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        BOOST_FOREACH(const Value& entry, results)
+            writer.push_back(entry);
     }
-
-    return results;
+    writer.Finish();
 }
 #endif
 
@@ -385,6 +440,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
     // mergedTx will end up with all the signatures; it
     // starts as a clone of the rawtx:
     CTransaction mergedTx(txVariants[0]);
+    mergedTx.SetMutable();
     bool fComplete = true;
 
     // Fetch previous transactions (inputs):
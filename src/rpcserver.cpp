@@ -35,6 +35,7 @@ using namespace boost::asio;
 using namespace json_spirit;
 
 static std::string strRPCUserColonPass;
+static bool fRPCStreaming = true;
 
 // These are created by StartRPCThreads, destroyed in StopRPCThreads
 static asio::io_service* rpc_io_service = NULL;
@@ -286,8 +287,9 @@ static const CRPCCommand vRPCCommands[] =
     { "listsinceblock",         &listsinceblock,         false,     false,     true },
     { "dumpprivkey",            &dumpprivkey,            false,     false,     true },
     { "dumpwallet",             &dumpwallet,             true,      false,     true },
-    { "importprivkey",          &importprivkey,          false,     false,     true },
-    { "importwallet",           &importwallet,           false,     false,     true },
+    { "importprivkey",          &importprivkey,          false,     true,      true },
+    { "importwallet",           &importwallet,           false,     true,      true },
+    { "getrescaninfo",          &getrescaninfo,          true,      true,      true },
     { "listunspent",            &listunspent,            false,     false,     true },
     { "settxfee",               &settxfee,               false,     false,     true },
     { "getsubsidy",             &getsubsidy,             true,      true,      false },
@@ -301,6 +303,17 @@ static const CRPCCommand vRPCCommands[] =
 #endif
 };
 
+// Commands whose (possibly large) array results can be sent as they are produced
+static const CRPCStreamCommand vRPCStreamCommands[] =
+{ //  name                      streamer (function)
+  //  ------------------------  -----------------------
+    { "getrawmempool",          &streamgetrawmempool     },
+#ifdef ENABLE_WALLET
+    { "listtransactions",       &streamlisttransactions  },
+    { "listunspent",            &streamlistunspent       },
+#endif
+};
+
 CRPCTable::CRPCTable()
 {
     unsigned int vcidx;
@@ -311,6 +324,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++)
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = &vRPCStreamCommands[vcidx];
 }
 
 const CRPCCommand *CRPCTable::operator[](string name) const
@@ -332,6 +347,73 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
+//
+// Streamed replies
+//
+
+// Bytes of JSON collected before a chunk is sent
+static const unsigned int RPC_STREAM_CHUNK_SIZE = 64 * 1024;
+
+CRPCStreamWriter::CRPCStreamWriter(std::ostream& streamIn, bool fKeepAliveIn) :
+    stream(streamIn), fKeepAlive(fKeepAliveIn), fObject(false), fStarted(false), fEmpty(true)
+{
+}
+
+void CRPCStreamWriter::Append(const string& str)
+{
+    if (fEmpty)
+    {
+        strBuffer.reserve(RPC_STREAM_CHUNK_SIZE + str.size());
+        strBuffer = fObject ? "{\"result\":{" : "{\"result\":[";
+        fEmpty = false;
+    }
+    else
+        strBuffer += ",";
+    strBuffer += str;
+    if (strBuffer.size() >= RPC_STREAM_CHUNK_SIZE)
+    {
+        Flush();
+        stream.flush();
+    }
+}
+
+void CRPCStreamWriter::Flush()
+{
+    if (!fStarted)
+    {
+        stream << HTTPChunkedReplyHeader(fKeepAlive);
+        fStarted = true;
+    }
+    if (strBuffer.empty())
+        return;
+    stream << strprintf("%x\r\n", strBuffer.size());
+    stream.write(strBuffer.data(), strBuffer.size());
+    stream << "\r\n";
+    strBuffer.clear();
+}
+
+void CRPCStreamWriter::push_back(const Value& value)
+{
+    assert(!fObject);
+    Append(write_string(value, false));
+}
+
+void CRPCStreamWriter::push_back(const Pair& pair)
+{
+    assert(fObject);
+    Append(write_string(Value(pair.name_), false) + ":" + write_string(pair.value_, false));
+}
+
+void CRPCStreamWriter::Finish()
+{
+    if (fEmpty)
+        strBuffer = fObject ? "{\"result\":{" : "{\"result\":[";
+    strBuffer += fObject ? "}" : "]";
+    strBuffer += ",\"error\":null,\"id\":" + write_string(id, false) + "}\n";
+    Flush();
+    stream << "0\r\n\r\n" << std::flush;
+}
+
 void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
 {
     // Send error reply from json-rpc error object
@@ -488,6 +570,7 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
 void StartRPCThreads()
 {
     strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
+    fRPCStreaming = GetBoolArg("-rpcstreaming", true);
     if (((mapArgs["-rpcpassword"] == "") ||
          (mapArgs["-rpcuser"] == mapArgs["-rpcpassword"])) && Params().RequireRPCPassword())
     {
@@ -754,6 +837,7 @@ void ServiceConnection(AcceptedConnection *conn)
             fRun = false;
 
         JSONRequest jreq;
+        CRPCStreamWriter writer(conn->stream(), fRun);
         try
         {
             // Parse request
@@ -767,6 +851,14 @@ void ServiceConnection(AcceptedConnection *conn)
             if (valRequest.type() == obj_type) {
                 jreq.parse(valRequest);
 
+                // HTTP/1.0 clients cannot take a chunked reply
+                if (nProto >= 1 && fRPCStreaming)
+                {
+                    writer.SetId(jreq.id);
+                    if (tableRPC.stream(jreq.strMethod, jreq.params, writer))
+                        continue;
+                }
+
                 Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
                 // Send reply
@@ -782,17 +874,55 @@ void ServiceConnection(AcceptedConnection *conn)
         }
         catch (Object& objError)
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
+            // A reply already under way can only be cut short
+            if (writer.IsStarted())
+                LogPrintf("ServiceConnection : %s aborted: %s\n", jreq.strMethod, find_value(objError, "message").get_str());
+            else
+                ErrorReply(conn->stream(), objError, jreq.id);
             break;
         }
         catch (std::exception& e)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+            if (writer.IsStarted())
+                LogPrintf("ServiceConnection : %s aborted: %s\n", jreq.strMethod, e.what());
+            else
+                ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
             break;
         }
     }
 }
 
+bool CRPCTable::stream(const std::string &strMethod, const json_spirit::Array &params, CRPCStreamWriter& writer) const
+{
+    map<string, const CRPCStreamCommand*>::const_iterator it = mapStreamCommands.find(strMethod);
+    if (it == mapStreamCommands.end())
+        return false;
+
+    // Same checks as execute()
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    if (!pcmd)
+        return false;
+#ifdef ENABLE_WALLET
+    if (pcmd->reqWallet && !pwalletMain)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+#endif
+
+    string strWarning = GetWarnings("rpc");
+    if (strWarning != "" && !GetBoolArg("-disablesafemode", false) &&
+        !pcmd->okSafeMode)
+        throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
+
+    try
+    {
+        it->second->actor(params, writer);
+        return true;
+    }
+    catch (std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
 {
     // Find method
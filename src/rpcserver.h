@@ -50,6 +50,54 @@ public:
     bool reqWallet;
 };
 
+/**
+ * Writes the reply to a singleton request one array element (or object
+ * member) at a time, as HTTP/1.1 chunks. Nothing reaches the connection
+ * until the first chunk is full, so errors raised before that still get
+ * an ordinary error reply.
+ */
+class CRPCStreamWriter
+{
+private:
+    std::ostream& stream;
+    bool fKeepAlive;
+    json_spirit::Value id;
+    std::string strBuffer;
+    bool fObject;
+    bool fStarted;
+    bool fEmpty;
+
+    void Append(const std::string& str);
+    void Flush();
+
+public:
+    CRPCStreamWriter(std::ostream& streamIn, bool fKeepAliveIn);
+
+    void SetId(const json_spirit::Value& idIn) { id = idIn; }
+    // The result is an object rather than an array; call before the first push_back
+    void BeginObject() { fObject = true; }
+    void push_back(const json_spirit::Value& value);
+    void push_back(const json_spirit::Pair& pair);
+    void Finish();
+
+    // Part of the reply has already been sent
+    bool IsStarted() const { return fStarted; }
+};
+
+/**
+ * Produces a command's result through a CRPCStreamWriter. Streamers do
+ * their own locking, and must not hold cs_main or cs_wallet while
+ * pushing to the writer, so a slow client never stalls the node.
+ */
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, CRPCStreamWriter& writer);
+
+class CRPCStreamCommand
+{
+public:
+    std::string name;
+    rpcstreamfn_type actor;
+};
+
 /**
  * Bitcoin RPC command dispatcher.
  */
@@ -57,6 +105,7 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, const CRPCStreamCommand*> mapStreamCommands;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -70,6 +119,13 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method through its streamer, if it has one.
+     * @returns false, having written nothing, when the method cannot be streamed.
+     * @throws an exception (json_spirit::Value) when an error happens.
+     */
+    bool stream(const std::string &method, const json_spirit::Array &params, CRPCStreamWriter& writer) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -106,6 +162,7 @@ extern json_spirit::Value getnettotals(const json_spirit::Array& params, bool fH
 
 extern json_spirit::Value dumpwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importwallet(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrescaninfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpprivkey(const json_spirit::Array& params, bool fHelp); // in rpcdump.cpp
 extern json_spirit::Value importprivkey(const json_spirit::Array& params, bool fHelp);
 
@@ -141,6 +198,7 @@ extern json_spirit::Value addredeemscript(const json_spirit::Array& params, bool
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+extern void streamlisttransactions(const json_spirit::Array& params, CRPCStreamWriter& writer);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
@@ -163,6 +221,7 @@ extern json_spirit::Value getnewpubkey(const json_spirit::Array& params, bool fH
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void streamlistunspent(const json_spirit::Array& params, CRPCStreamWriter& writer);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decodescript(const json_spirit::Array& params, bool fHelp);
@@ -174,6 +233,7 @@ extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool f
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void streamgetrawmempool(const json_spirit::Array& params, CRPCStreamWriter& writer);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
@@ -591,7 +591,6 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
 
     // Credit
     CAccountingEntry credit;
@@ -601,11 +600,19 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
 
+    if (!walletdb.WriteAccountingEntry(debit) || !walletdb.WriteAccountingEntry(credit))
+    {
+        walletdb.TxnAbort();
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    }
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    // Only entries that reached the database go into the activity log
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -1067,11 +1074,10 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1101,6 +1107,127 @@ Value listtransactions(const Array& params, bool fHelp)
     return ret;
 }
 
+// Number of entries ListOrderedItem returns for an item, without building them
+static int64_t CountOrderedItem(const CWallet::TxPair& item, const string& strAccount)
+{
+    bool fAllAccounts = (strAccount == string("*"));
+    int64_t nEntries = 0;
+    if (item.first != 0)
+    {
+        // Mirrors ListTransactions with nMinDepth 0
+        const CWalletTx& wtx = *item.first;
+        CAmount nFee;
+        string strSentAccount;
+        list<pair<CTxDestination, CAmount> > listReceived;
+        list<pair<CTxDestination, CAmount> > listSent;
+        wtx.GetAmounts(listReceived, listSent, nFee, strSentAccount);
+
+        if ((!wtx.IsCoinStake()) && (!listSent.empty() || nFee != 0) && (fAllAccounts || strAccount == strSentAccount))
+            nEntries += listSent.size();
+
+        if (listReceived.size() > 0 && wtx.GetDepthInMainChain() >= 0)
+        {
+            BOOST_FOREACH(const PAIRTYPE(CTxDestination, CAmount)& r, listReceived)
+            {
+                string account;
+                if (pwalletMain->mapAddressBook.count(r.first))
+                    account = pwalletMain->mapAddressBook[r.first];
+                if (fAllAccounts || (account == strAccount))
+                {
+                    nEntries++;
+                    if (wtx.IsCoinStake())
+                        break; // only one coinstake output
+                }
+            }
+        }
+    }
+    if (item.second != 0 && (fAllAccounts || item.second->strAccount == strAccount))
+        nEntries++;
+    return nEntries;
+}
+
+// Entries for one wallet activity item, in the order listtransactions returns them
+static void ListOrderedItem(const CWallet::TxPair& item, const string& strAccount, Array& ret)
+{
+    Array entries;
+    if (item.first != 0)
+        ListTransactions(*item.first, strAccount, 0, true, entries);
+    if (item.second != 0)
+        AcentryToJSON(*item.second, strAccount, entries);
+    ret.insert(ret.end(), entries.rbegin(), entries.rend());
+}
+
+void streamlisttransactions(const Array& params, CRPCStreamWriter& writer)
+{
+    if (params.size() > 3)
+        listtransactions(params, true);
+
+    string strAccount = "*";
+    if (params.size() > 0)
+        strAccount = params[0].get_str();
+    int nCount = 10;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    int nFrom = 0;
+    if (params.size() > 2)
+        nFrom = params[2].get_int();
+
+    if (nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+    if (nFrom < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+
+    // Count entries backwards as listtransactions does, to find the oldest
+    // item needed and which of the entries from there on are returned. Only
+    // the second pass builds JSON, one batch at a time.
+    int64_t nStartPos = 0;
+    int64_t nTotal = 0;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+        for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+        {
+            nStartPos = (*it).first;
+            nTotal += CountOrderedItem((*it).second, strAccount);
+            if (nTotal >= (int64_t)nCount + nFrom) break;
+        }
+    }
+    int64_t nBegin = nTotal - std::min(nTotal, (int64_t)nCount + nFrom);
+    int64_t nEnd = nTotal - std::min(nTotal, (int64_t)nFrom);
+
+    // Then walk forwards, oldest to newest, a batch of items at a time
+    static const unsigned int nBatch = 1000;
+    int64_t nEntry = 0;
+    bool fFirst = true;
+    while (nEntry < nEnd)
+    {
+        Array ret;
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+            CWallet::TxItems::const_iterator it = fFirst ? txOrdered.lower_bound(nStartPos) : txOrdered.upper_bound(nStartPos);
+            if (it == txOrdered.end())
+                break;
+            for (unsigned int n = 0; it != txOrdered.end() && n < nBatch && nEntry < nEnd; ++it, n++)
+            {
+                Array entries;
+                ListOrderedItem((*it).second, strAccount, entries);
+                BOOST_FOREACH(const Value& entry, entries)
+                {
+                    if (nEntry >= nBegin && nEntry < nEnd)
+                        ret.push_back(entry);
+                    nEntry++;
+                }
+                nStartPos = (*it).first;
+            }
+            fFirst = false;
+        }
+        BOOST_FOREACH(const Value& entry, ret)
+            writer.push_back(entry);
+    }
+    writer.Finish();
+}
+
 Value listaccounts(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -1144,9 +1271,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1264,7 +1389,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -3,9 +3,9 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -1117,6 +1117,7 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         return 1;
     }
     CTransaction txTmp(txTo);
+    txTmp.SetMutable();
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
@@ -1174,63 +1175,134 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are salted hashes of (signature hash, signature, public key) kept in
+// a fixed table of 4-entry buckets, so lookups and inserts do not allocate.
+// Buckets are grouped into stripes with their own lock, and a full bucket
+// evicts one of its own entries.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int BUCKET_SIZE = 4;
+    static const unsigned int STRIPES = 64;
+
+    uint256 nSalt;
+    std::vector<uint256> vEntries;
+    unsigned int nBuckets;
+    boost::shared_mutex cs_stripe[STRIPES];
+
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+    std::atomic<uint64_t> nInserts;
+    std::atomic<uint64_t> nEvictions;
+
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, &nSalt, sizeof(nSalt));
+        SHA256_Update(&ctx, &hash, sizeof(hash));
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        SHA256_Final((unsigned char*)&entry, &ctx);
+        return entry;
+    }
+
+    unsigned int GetBucket(const uint256 &entry) const
+    {
+        return entry.GetLow64() % nBuckets;
+    }
 
 public:
+    CSignatureCache() : nHits(0), nMisses(0), nInserts(0), nEvictions(0)
+    {
+        nSalt = GetRandHash();
+        int64_t nSizeMB = std::max((int64_t)0, GetArg("-sigcachesizemb", DEFAULT_SIGCACHE_SIZE_MB));
+        nBuckets = std::max((uint64_t)1, ((uint64_t)nSizeMB << 20) / (sizeof(uint256) * BUCKET_SIZE));
+        vEntries.resize((size_t)nBuckets * BUCKET_SIZE);
+        if (nSizeMB == 0)
+            nBuckets = 0;
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        if (nBuckets == 0)
+            return false;
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        unsigned int nBucket = GetBucket(entry);
+        {
+            boost::shared_lock<boost::shared_mutex> lock(cs_stripe[nBucket % STRIPES]);
+            const uint256* pbucket = &vEntries[(size_t)nBucket * BUCKET_SIZE];
+            for (unsigned int i = 0; i < BUCKET_SIZE; i++)
+            {
+                if (pbucket[i] == entry)
+                {
+                    nHits++;
+                    return true;
+                }
+            }
+        }
+        nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        if (nBuckets == 0)
+            return;
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        unsigned int nBucket = GetBucket(entry);
+
+        boost::unique_lock<boost::shared_mutex> lock(cs_stripe[nBucket % STRIPES]);
+        uint256* pbucket = &vEntries[(size_t)nBucket * BUCKET_SIZE];
+        for (unsigned int i = 0; i < BUCKET_SIZE; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pbucket[i] == entry)
+                return;
+            if (pbucket[i] == 0)
+            {
+                pbucket[i] = entry;
+                nInserts++;
+                return;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Bucket is full: evict an entry picked by the (salted, so unpredictable)
+        // new entry, to foil attackers pre-generating signatures that collide
+        pbucket[entry.begin()[8] % BUCKET_SIZE] = entry;
+        nInserts++;
+        nEvictions++;
+    }
+
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats.nSizeBytes = vEntries.size() * sizeof(uint256);
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nInserts = nInserts;
+        stats.nEvictions = nEvictions;
     }
 };
 
+static CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1714,6 +1786,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     assert(nIn < txTo.vin.size());
+    txTo.SetMutable();
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
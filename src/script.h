@@ -730,6 +730,20 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                    unsigned int flags, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
+/** -sigcachesizemb default */
+static const int64_t DEFAULT_SIGCACHE_SIZE_MB = 16;
+
+struct CSignatureCacheStats
+{
+    uint64_t nSizeBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+};
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -0,0 +1,58 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "kernel.h"
+#include "util.h"
+
+using namespace std;
+
+// Reference implementation of the kernel hash and target check
+static bool CheckKernelReference(const uint256& nStakeModifier, unsigned int nBits, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(nValueIn);
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    return !(CBigNum(hashProofOfStake) > bnTarget);
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(kernel_hasher_matches_reference)
+{
+    const unsigned int vBits[] = { 0x1d00ffff, 0x1e0fffff, 0x207fffff, 0x2100ffff, 0x03123456, 0x01123456, 0x1c800000 };
+    const CAmount vValue[] = { 0, 1, COIN, 1000 * COIN, MAX_MONEY };
+
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+        uint256 nStakeModifier = GetRandHash();
+        COutPoint prevout(GetRandHash(), GetRandInt(10));
+        unsigned int nTimeTxPrev = GetRand(1 << 30);
+        unsigned int nTimeTx = nTimeTxPrev + GetRand(1 << 20);
+        unsigned int nBits = vBits[i % (sizeof(vBits) / sizeof(vBits[0]))];
+        CAmount nValue = vValue[i % (sizeof(vValue) / sizeof(vValue[0]))];
+
+        uint256 hashRef;
+        bool fRef = CheckKernelReference(nStakeModifier, nBits, nTimeTxPrev, nValue, prevout, nTimeTx, hashRef);
+
+        CStakeKernelHasher hasher(nStakeModifier, nBits, nTimeTxPrev, nValue, prevout);
+        uint256 hash = hasher.GetHash(nTimeTx);
+        BOOST_CHECK(hash == hashRef);
+        BOOST_CHECK(hasher.CheckHash(hash) == fRef);
+
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        bnTarget *= CBigNum(nValue);
+        BOOST_CHECK(hasher.GetTarget() == bnTarget.getuint256());
+
+        // A hash equal to the (truncated) target
+        uint256 hashAtTarget = bnTarget.getuint256();
+        BOOST_CHECK(hasher.CheckHash(hashAtTarget) == !(CBigNum(hashAtTarget) > bnTarget));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,150 @@
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+// A tx database in a fresh data directory, removed again afterwards
+struct TxDBSetup
+{
+    boost::filesystem::path pathTemp;
+
+    TxDBSetup()
+    {
+        pathTemp = boost::filesystem::temp_directory_path() / strprintf("test_labh_%lu", (unsigned long)GetTime() ^ GetRand(1 << 30));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+    }
+
+    ~TxDBSetup()
+    {
+        CTxDB().Close();
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+// Coinstake whose kernel spends output 0 of hashPrev
+static CTransaction MakeCoinStake(const uint256& hashPrev)
+{
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(hashPrev, 0)));
+    tx.vout.resize(2);
+    tx.vout[0].SetEmpty();
+    tx.vout[1].nValue = COIN;
+    return tx;
+}
+
+// First height from nHeight on that is (or is not) a superblock
+static int FindHeight(int nHeight, bool fSuperblock)
+{
+    while (IlIII(nHeight) != fSuperblock)
+        nHeight++;
+    return nHeight;
+}
+
+BOOST_AUTO_TEST_SUITE(main_tests)
+
+BOOST_AUTO_TEST_CASE(stake_lineage_check)
+{
+    int nMin = Params().MinStakingBeforeSuperblock();
+    int nSuperblock = FindHeight(1000, true);
+    int nBucket = llIII(nSuperblock);
+
+    // Enough generations since a superblock in another bucket
+    BOOST_CHECK(CheckStakeLineage(CStakeLineage(nMin, -1), nSuperblock));
+    BOOST_CHECK(CheckStakeLineage(CStakeLineage(nMin, nBucket + 1), nSuperblock));
+    BOOST_CHECK(!CheckStakeLineage(CStakeLineage(nMin - 1, -1), nSuperblock));
+
+    // Never twice in the same superblock bucket
+    BOOST_CHECK(!CheckStakeLineage(CStakeLineage(STAKE_LINEAGE_MAX_DEPTH - 1, nBucket), nSuperblock));
+
+    // Next() counts a generation, capped at the walk depth
+    BOOST_CHECK_EQUAL(CStakeLineage(0, nBucket).Next().nStakes, 1);
+    BOOST_CHECK_EQUAL(CStakeLineage(0, nBucket).Next().nSuperblockBucket, nBucket);
+    BOOST_CHECK_EQUAL(CStakeLineage(STAKE_LINEAGE_MAX_DEPTH - 1, nBucket).Next().nStakes, STAKE_LINEAGE_MAX_DEPTH);
+    BOOST_CHECK_EQUAL(CStakeLineage(STAKE_LINEAGE_MAX_DEPTH - 1, nBucket).Next().nSuperblockBucket, -1);
+}
+
+BOOST_AUTO_TEST_CASE(stake_lineage_index)
+{
+    TxDBSetup setup;
+    CTxDB txdb("cr+");
+
+    uint256 hashPrev = GetRandHash();
+    BOOST_CHECK(txdb.WriteStakeLineage(hashPrev, CStakeLineage(3, 7)));
+
+    // A coinstake's lineage is that of the coinstake it spends
+    CTransaction txStake = MakeCoinStake(hashPrev);
+    CStakeLineage lineage;
+    BOOST_CHECK(GetStakeLineage(txdb, txStake, lineage));
+    BOOST_CHECK_EQUAL(lineage.nStakes, 3);
+    BOOST_CHECK_EQUAL(lineage.nSuperblockBucket, 7);
+
+    // Connected at a normal height it counts one more generation, connected
+    // at a superblock it starts over from that superblock's bucket
+    int nHeight = FindHeight(1000, false);
+    BOOST_CHECK(GetConnectedStakeLineage(txdb, txStake, nHeight, lineage));
+    BOOST_CHECK_EQUAL(lineage.nStakes, 4);
+    BOOST_CHECK_EQUAL(lineage.nSuperblockBucket, 7);
+    int nSuperblock = FindHeight(1000, true);
+    BOOST_CHECK(GetConnectedStakeLineage(txdb, txStake, nSuperblock, lineage));
+    BOOST_CHECK_EQUAL(lineage.nStakes, 0);
+    BOOST_CHECK_EQUAL(lineage.nSuperblockBucket, llIII(nSuperblock));
+
+    // Anything but a coinstake has an empty lineage
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(hashPrev, 0)));
+    tx.vout.resize(1);
+    BOOST_CHECK(GetStakeLineage(txdb, tx, lineage));
+    BOOST_CHECK_EQUAL(lineage.nStakes, 0);
+    BOOST_CHECK_EQUAL(lineage.nSuperblockBucket, -1);
+
+    // Neither indexed nor on disk
+    BOOST_CHECK(!GetStakeLineage(txdb, MakeCoinStake(GetRandHash()), lineage));
+}
+
+BOOST_AUTO_TEST_CASE(stake_lineage_reorganize)
+{
+    TxDBSetup setup;
+    uint256 hashOld = GetRandHash();
+    uint256 hashNew = GetRandHash();
+    {
+        CTxDB txdb("cr+");
+        BOOST_CHECK(txdb.WriteStakeLineage(hashOld, CStakeLineage(5, -1)));
+    }
+
+    // A reorganize disconnects hashOld and connects hashNew in one batch
+    CTxDB txdb("r+");
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.EraseStakeLineage(hashOld));
+    BOOST_CHECK(txdb.WriteStakeLineage(hashNew, CStakeLineage(1, 2)));
+
+    int nHeight = FindHeight(1000, false);
+    CStakeLineage lineage;
+    CTxDB txdbCommitted("r");
+
+    // The committed view still sees the disconnected coinstake, but the
+    // lineage written for the new block must not be built on it
+    BOOST_CHECK(GetStakeLineage(txdbCommitted, MakeCoinStake(hashOld), lineage));
+    BOOST_CHECK_EQUAL(lineage.nStakes, 5);
+    BOOST_CHECK(!GetConnectedStakeLineage(txdb, MakeCoinStake(hashOld), nHeight, lineage));
+
+    // Only the batch sees the newly connected one
+    BOOST_CHECK(!GetStakeLineage(txdbCommitted, MakeCoinStake(hashNew), lineage));
+    BOOST_CHECK(GetConnectedStakeLineage(txdb, MakeCoinStake(hashNew), nHeight, lineage));
+    BOOST_CHECK_EQUAL(lineage.nStakes, 2);
+    BOOST_CHECK_EQUAL(lineage.nSuperblockBucket, 2);
+
+    // After the commit both views agree
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(!GetStakeLineage(txdbCommitted, MakeCoinStake(hashOld), lineage));
+    BOOST_CHECK(GetStakeLineage(txdbCommitted, MakeCoinStake(hashNew), lineage));
+    BOOST_CHECK_EQUAL(lineage.nStakes, 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
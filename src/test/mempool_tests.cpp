@@ -0,0 +1,109 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+using namespace std;
+
+// Transaction spending the given outputs, with one output of its own
+static CTransaction MakeTx(const vector<COutPoint>& vPrevout)
+{
+    CTransaction tx;
+    BOOST_FOREACH(const COutPoint& prevout, vPrevout)
+        tx.vin.push_back(CTxIn(prevout));
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static void AddTx(CTxMemPool& pool, CTransaction& tx, CAmount nFee, unsigned int nSize)
+{
+    pool.addUnchecked(tx.GetHash(), tx, CTxMemPoolEntry(nFee, nSize, 1, 0, vector<CAmount>(tx.vin.size(), COIN)));
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_state)
+{
+    CTxMemPool pool;
+
+    // parent -> child -> grandchild, plus an unrelated transaction
+    CTransaction txParent = MakeTx(vector<COutPoint>(1, COutPoint(GetRandHash(), 0)));
+    CTransaction txChild = MakeTx(vector<COutPoint>(1, COutPoint(txParent.GetHash(), 0)));
+    CTransaction txGrandChild = MakeTx(vector<COutPoint>(1, COutPoint(txChild.GetHash(), 0)));
+    CTransaction txOther = MakeTx(vector<COutPoint>(1, COutPoint(GetRandHash(), 0)));
+
+    AddTx(pool, txParent, 1000, 200);
+    AddTx(pool, txChild, 50000, 300);
+    AddTx(pool, txGrandChild, 0, 500);
+    AddTx(pool, txOther, 20000, 250);
+
+    CTxMemPoolEntry entry;
+    BOOST_CHECK(pool.lookupEntry(txGrandChild.GetHash(), entry));
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(entry.GetSizeWithAncestors(), 1000U);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithAncestors(), 51000);
+    BOOST_CHECK_EQUAL(entry.GetValueIn(), COIN);
+
+    vector<const CTxMemPoolEntry*> vAncestors;
+    pool.GetSortedAncestors(txGrandChild.GetHash(), vAncestors);
+    BOOST_CHECK_EQUAL(vAncestors.size(), 2U);
+    BOOST_CHECK(vAncestors[0]->GetTx().GetHash() == txParent.GetHash());
+    BOOST_CHECK(vAncestors[1]->GetTx().GetHash() == txChild.GetHash());
+
+    // The child package (51000 per 500 bytes) ranks above the unrelated transaction
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 4U);
+    BOOST_CHECK(pool.setByAncestorFeeRate.rbegin()->second == txChild.GetHash());
+    BOOST_CHECK((++pool.setByAncestorFeeRate.rbegin())->second == txOther.GetHash());
+
+    // Mining the parent leaves the descendants with one ancestor less
+    list<CTransaction> removed;
+    pool.remove(txParent, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+    BOOST_CHECK(pool.lookupEntry(txGrandChild.GetHash(), entry));
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(entry.GetSizeWithAncestors(), 800U);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithAncestors(), 50000);
+
+    // Putting it back, as a reorganize would, restores them
+    AddTx(pool, txParent, 1000, 200);
+    BOOST_CHECK(pool.lookupEntry(txGrandChild.GetHash(), entry));
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithAncestors(), 51000);
+
+    // Removing recursively takes the whole chain and its index entries
+    removed.clear();
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapEntry.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 1U);
+    BOOST_CHECK(pool.mapNextTx.size() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_readd_chain)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = MakeTx(vector<COutPoint>(1, COutPoint(GetRandHash(), 0)));
+    CTransaction txChild = MakeTx(vector<COutPoint>(1, COutPoint(txParent.GetHash(), 0)));
+    CTransaction txGrandChild = MakeTx(vector<COutPoint>(1, COutPoint(txChild.GetHash(), 0)));
+
+    // A reorganize puts back the parent, then the child, under a grandchild already in the pool
+    AddTx(pool, txGrandChild, 0, 500);
+    AddTx(pool, txParent, 1000, 200);
+    AddTx(pool, txChild, 50000, 300);
+
+    CTxMemPoolEntry entry;
+    BOOST_CHECK(pool.lookupEntry(txGrandChild.GetHash(), entry));
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(entry.GetSizeWithAncestors(), 1000U);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithAncestors(), 51000);
+
+    // The index holds each transaction once, keyed by its current package
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 3U);
+    BOOST_CHECK(pool.setByAncestorFeeRate.count(CTxMemPool::FeeRateKey(entry.GetAncestorFeeRate(), txGrandChild.GetHash())));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
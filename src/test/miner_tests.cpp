@@ -0,0 +1,165 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "miner.h"
+#include "txmempool.h"
+
+using namespace std;
+
+// Every transaction outside the pool is confirmed with one unspent output,
+// in the block at position (1, 1) unless it is the view's coinstake
+class CSyntheticView : public CBlockAssemblyView
+{
+public:
+    CSyntheticView() : CBlockAssemblyView(NULL) {}
+
+    CTransaction txCoinStake; // confirmed in the block at position (1, 2)
+
+protected:
+    bool ReadTxIndex(const uint256& hash, CTxIndex& txindex)
+    {
+        bool fCoinStake = !txCoinStake.IsNull() && hash == txCoinStake.GetHash();
+        txindex = CTxIndex(CDiskTxPos(1, fCoinStake ? 2 : 1, 1), 1);
+        return true;
+    }
+
+    bool ReadTx(const CTxIndex& txindex, CTransaction& tx)
+    {
+        if (txindex.pos.nBlockPos == 2)
+        {
+            tx = txCoinStake;
+            return true;
+        }
+        tx = CTransaction();
+        tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+        tx.vout.resize(1);
+        return true;
+    }
+};
+
+// A pool of nTx transactions, one in four spending an earlier pool transaction
+static void FillPool(CTxMemPool& pool, unsigned int nTx)
+{
+    vector<uint256> vUnspent; // pool transactions whose output is not spent yet
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.nTime = GetAdjustedTime() - 60;
+        if (i % 4 == 3 && !vUnspent.empty())
+        {
+            unsigned int n = GetRandInt(vUnspent.size());
+            tx.vin.push_back(CTxIn(COutPoint(vUnspent[n], 0)));
+            vUnspent[n] = vUnspent.back();
+            vUnspent.pop_back();
+        }
+        else
+            tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+        tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1) << vector<unsigned char>(33, 2);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 3) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        CAmount nFee = MIN_TX_FEE * (1 + GetRandInt(20));
+        uint256 hash = tx.GetHash();
+        pool.addUnchecked(hash, tx, CTxMemPoolEntry(nFee, nSize, 1, tx.nTime, vector<CAmount>(1, COIN)));
+        vUnspent.push_back(hash);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(miner_tests)
+
+BOOST_AUTO_TEST_CASE(assembly_view_spends)
+{
+    CSyntheticView view;
+
+    CTransaction txParent;
+    txParent.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    txParent.vout.resize(2);
+    BOOST_CHECK(view.ConnectTx(txParent, 100));
+
+    // Spending the parent's outputs, once each
+    CTransaction txChild;
+    txChild.vin.push_back(CTxIn(COutPoint(txParent.GetHash(), 0)));
+    txChild.vout.resize(1);
+    BOOST_CHECK(view.ConnectTx(txChild, 100));
+
+    CTransaction txDoubleSpend;
+    txDoubleSpend.vin.push_back(CTxIn(COutPoint(txParent.GetHash(), 1)));
+    txDoubleSpend.vin.push_back(CTxIn(COutPoint(txParent.GetHash(), 0)));
+    BOOST_CHECK(!view.ConnectTx(txDoubleSpend, 100));
+
+    // The failed transaction left output 1 unspent
+    CTransaction txOther;
+    txOther.vin.push_back(CTxIn(COutPoint(txParent.GetHash(), 1)));
+    BOOST_CHECK(view.ConnectTx(txOther, 100));
+
+    // Confirmed transactions in this view have a single output
+    CTransaction txMissing;
+    txMissing.vin.push_back(CTxIn(COutPoint(GetRandHash(), 1)));
+    BOOST_CHECK(!view.ConnectTx(txMissing, 100));
+}
+
+BOOST_AUTO_TEST_CASE(assembly_view_maturity)
+{
+    CSyntheticView view;
+    view.txCoinStake.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    view.txCoinStake.vout.resize(2);
+    view.txCoinStake.vout[0].SetEmpty();
+    view.txCoinStake.vout[1].nValue = COIN;
+    BOOST_CHECK(view.txCoinStake.IsCoinStake());
+
+    CBlockIndex blockindex;
+    blockindex.nFile = 1;
+    blockindex.nBlockPos = 2;
+    blockindex.nHeight = 100;
+    mapBlockPos[BlockPosKey(1, 2)] = &blockindex;
+
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(COutPoint(view.txCoinStake.GetHash(), 0)));
+    txSpend.vout.resize(1);
+
+    // One block short of maturity, then mature
+    BOOST_CHECK(!view.ConnectTx(txSpend, 100 + nCoinbaseMaturity));
+    BOOST_CHECK(view.ConnectTx(txSpend, 101 + nCoinbaseMaturity));
+
+    mapBlockPos.erase(BlockPosKey(1, 2));
+
+    // A coinstake in a block we cannot find is never mature
+    CSyntheticView viewUnknown;
+    viewUnknown.txCoinStake = view.txCoinStake;
+    BOOST_CHECK(!viewUnknown.ConnectTx(txSpend, 101 + nCoinbaseMaturity));
+    BOOST_CHECK(!viewUnknown.ConnectTx(txSpend, 1000 + nCoinbaseMaturity));
+}
+
+BOOST_AUTO_TEST_CASE(assembly_package_order)
+{
+    CTxMemPool pool;
+    FillPool(pool, 500);
+
+    CBlock block;
+    block.vtx.resize(1);
+    CSyntheticView view;
+    uint64_t nBlockSize = 1000;
+    uint64_t nBlockTx = 0;
+    {
+        LOCK(pool.cs);
+        AddPoolTransactions(pool, &block, view, 1000, false, MAX_BLOCK_SIZE_GEN/2, 0, MIN_TX_FEE, nBlockSize, nBlockTx);
+    }
+
+    // Parents go in before their children, and no output is spent twice
+    set<uint256> setInBlock;
+    set<COutPoint> setSpent;
+    for (unsigned int n = 1; n < block.vtx.size(); n++)
+    {
+        const CTxIn& txin = block.vtx[n].vin[0];
+        BOOST_CHECK(setSpent.insert(txin.prevout).second);
+        if (pool.exists(txin.prevout.hash))
+            BOOST_CHECK(setInBlock.count(txin.prevout.hash));
+        setInBlock.insert(block.vtx[n].GetHash());
+    }
+    BOOST_CHECK_EQUAL(block.vtx.size(), nBlockTx + 1);
+    BOOST_CHECK(nBlockSize < MAX_BLOCK_SIZE_GEN/2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
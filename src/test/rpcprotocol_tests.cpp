@@ -0,0 +1,66 @@
+#include <boost/test/unit_test.hpp>
+
+#include "rpcprotocol.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <sstream>
+
+using namespace std;
+
+// Parse a chunked request body, leaving whatever follows it in the stream
+static int ReadChunked(const string& strBody, string& strMessage, string& strRest)
+{
+    istringstream stream("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" + strBody);
+    map<string, string> mapHeaders;
+    int nStatus = ReadHTTPMessage(stream, mapHeaders, strMessage, 1);
+    strRest.clear();
+    if (stream)
+        strRest.assign(istreambuf_iterator<char>(stream), istreambuf_iterator<char>());
+    return nStatus;
+}
+
+BOOST_AUTO_TEST_SUITE(rpcprotocol_tests)
+
+BOOST_AUTO_TEST_CASE(chunked_body)
+{
+    string strMessage, strRest;
+
+    // Several chunks, one with an extension, and upper case hex
+    BOOST_CHECK_EQUAL(ReadChunked("5\r\n{\"id\"\r\n3;ext=1\r\n:1,\r\nA\r\n\"params\":[\r\n2\r\n]}\r\n0\r\n\r\nNEXT", strMessage, strRest), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, "{\"id\":1,\"params\":[]}");
+    BOOST_CHECK_EQUAL(strRest, "NEXT");
+
+    // Trailers are read up to the empty line and dropped
+    BOOST_CHECK_EQUAL(ReadChunked("2\r\n[]\r\n0\r\nX-Checksum: 1234\r\nX-Other: 5\r\n\r\nNEXT", strMessage, strRest), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, "[]");
+    BOOST_CHECK_EQUAL(strRest, "NEXT");
+
+    // An empty body
+    BOOST_CHECK_EQUAL(ReadChunked("0\r\n\r\n", strMessage, strRest), HTTP_OK);
+    BOOST_CHECK(strMessage.empty());
+}
+
+BOOST_AUTO_TEST_CASE(chunked_body_invalid)
+{
+    string strMessage, strRest;
+
+    // Size lines that are not hex
+    BOOST_CHECK_EQUAL(ReadChunked("zz\r\n[]\r\n0\r\n\r\n", strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+    BOOST_CHECK_EQUAL(ReadChunked("\r\n[]\r\n0\r\n\r\n", strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+    BOOST_CHECK_EQUAL(ReadChunked("-1\r\n[]\r\n0\r\n\r\n", strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+
+    // Chunk data longer than its size line says
+    BOOST_CHECK_EQUAL(ReadChunked("1\r\n[]\r\n0\r\n\r\n", strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+
+    // Truncated chunk data, and a body without its last chunk
+    BOOST_CHECK_EQUAL(ReadChunked("10\r\n[1,2,3]", strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+    BOOST_CHECK_EQUAL(ReadChunked("2\r\n[]\r\n", strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+
+    // A single chunk, or the chunks together, larger than MAX_SIZE
+    BOOST_CHECK_EQUAL(ReadChunked(strprintf("%x\r\n", MAX_SIZE + 1), strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+    BOOST_CHECK_EQUAL(ReadChunked("ffffffffffffffffffff\r\n", strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+    BOOST_CHECK_EQUAL(ReadChunked(strprintf("4\r\n[1,2\r\n%x\r\n", MAX_SIZE - 3), strMessage, strRest), HTTP_INTERNAL_SERVER_ERROR);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
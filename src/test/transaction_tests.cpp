@@ -0,0 +1,70 @@
+#include <boost/test/unit_test.hpp>
+
+#include "keystore.h"
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(transaction_tests)
+
+BOOST_AUTO_TEST_CASE(transaction_cache)
+{
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 1)));
+    tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = COIN;
+    BOOST_CHECK(!tx.IsImmutable());
+    uint256 hash = tx.GetHash();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // A deserialized transaction serves its hash and size from the cache
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(txRead.IsImmutable());
+    uint64_t nComputed = nTxHashesComputed;
+    BOOST_CHECK(txRead.GetHash() == hash);
+    BOOST_CHECK_EQUAL(nTxHashesComputed, nComputed);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txRead, SER_NETWORK, PROTOCOL_VERSION), nSize);
+
+    // An edited copy hashes its new contents
+    CTransaction txEdit(txRead);
+    txEdit.SetMutable();
+    txEdit.vout[0].nValue = 2 * COIN;
+    BOOST_CHECK(txEdit.GetHash() != hash);
+    txEdit.vout[0].nValue = COIN;
+    BOOST_CHECK(txEdit.GetHash() == hash);
+}
+
+BOOST_AUTO_TEST_CASE(transaction_cache_sign)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = COIN;
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(txFrom.GetHash(), 0)));
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+
+    // Signing a deserialized transaction in place drops its cached hash
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CTransaction txRead;
+    ss >> txRead;
+    uint256 hashUnsigned = txRead.GetHash();
+    BOOST_CHECK(SignSignature(keystore, txFrom, txRead, 0));
+    BOOST_CHECK(!txRead.IsImmutable());
+    BOOST_CHECK(txRead.GetHash() != hashUnsigned);
+    BOOST_CHECK(txRead.GetHash() == SerializeHash(txRead));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
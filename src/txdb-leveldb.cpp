@@ -6,6 +6,7 @@
 #include <map>
 
 #include <boost/version.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
@@ -262,6 +263,22 @@ bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
+bool CTxDB::ReadStakeLineage(uint256 hash, CStakeLineage& lineage)
+{
+    lineage.SetNull();
+    return Read(make_pair(string("stakelineage"), hash), lineage);
+}
+
+bool CTxDB::WriteStakeLineage(uint256 hash, const CStakeLineage& lineage)
+{
+    return Write(make_pair(string("stakelineage"), hash), lineage);
+}
+
+bool CTxDB::EraseStakeLineage(uint256 hash)
+{
+    return Erase(make_pair(string("stakelineage"), hash));
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -282,20 +299,109 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
+// Read-only stream over a leveldb::Slice, so index entries can be
+// deserialized without first copying them into a CDataStream
+class CSliceReader
+{
+private:
+    const char* pbegin;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CSliceReader(const leveldb::Slice& slice, int nTypeIn, int nVersionIn) :
+        pbegin(slice.data()), pend(slice.data() + slice.size()), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CSliceReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pbegin))
+            throw std::ios_base::failure("CSliceReader::read() : end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return *this;
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    template<typename T>
+    CSliceReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return *this;
+    }
+};
+
+// A block index entry decoded by one of the LoadBlockIndex workers
+struct CLoadedBlockIndex
+{
+    uint256 hash;
+    uint256 nBlockTrust;
+    CDiskBlockIndex diskindex;
+};
+
+// Decode the block index entries whose hash starts with a byte in [nBegin, nEnd).
+// The block hash is taken from the key; rehashing the stored header (scrypt for
+// old block versions) is left to the -checkblocks pass.
+static void LoadBlockIndexShard(leveldb::DB* pdb, unsigned int nBegin, unsigned int nEnd,
+    vector<CLoadedBlockIndex>* pvLoaded, bool* pfError)
+{
+    try
+    {
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << string("blockindex");
+        const string strPrefix = ssPrefix.str();
+
+        uint256 hashStart = 0;
+        *hashStart.begin() = nBegin;
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << make_pair(string("blockindex"), hashStart);
+
+        leveldb::ReadOptions options;
+        options.fill_cache = false;
+        leveldb::Iterator* iterator = pdb->NewIterator(options);
+        for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+        {
+            boost::this_thread::interruption_point();
+            leveldb::Slice key = iterator->key();
+            if (key.size() != strPrefix.size() + sizeof(uint256) || memcmp(key.data(), strPrefix.data(), strPrefix.size()) != 0)
+                break;
+            if ((unsigned char)key[strPrefix.size()] >= nEnd)
+                break;
+
+            pvLoaded->push_back(CLoadedBlockIndex());
+            CLoadedBlockIndex& loaded = pvLoaded->back();
+            CSliceReader(iterator->value(), SER_DISK, CLIENT_VERSION) >> loaded.diskindex;
+            memcpy(loaded.hash.begin(), key.data() + strPrefix.size(), sizeof(uint256));
+            loaded.nBlockTrust = loaded.diskindex.GetBlockTrust();
+        }
+        delete iterator;
+    }
+    catch (boost::thread_interrupted)
+    {
+        *pfError = true;
+        throw;
+    }
+    catch (std::exception& e)
+    {
+        LogPrintf("LoadBlockIndexShard() : %s\n", e.what());
+        *pfError = true;
+    }
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (blockIndexArena.Allocate()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -312,66 +418,79 @@ bool CTxDB::LoadBlockIndex()
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    //
+    // Entries are decoded in parallel, each worker covering a range of the
+    // first byte of the block hash, and then linked together on this thread.
+    unsigned int nShards = std::max(1U, std::min(16U, boost::thread::hardware_concurrency()));
+    vector<vector<CLoadedBlockIndex> > vShards(nShards);
+    bool fShardError[16] = {};
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+        boost::thread_group threadGroup;
+        for (unsigned int i = 0; i < nShards; i++)
+            threadGroup.create_thread(boost::bind(&LoadBlockIndexShard, pdb, 256 * i / nShards, 256 * (i + 1) / nShards,
+                &vShards[i], &fShardError[i]));
+        try {
+            threadGroup.join_all();
+        } catch (boost::thread_interrupted) {
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            throw;
         }
+    }
+    for (unsigned int i = 0; i < nShards; i++)
+        if (fShardError[i])
+            return error("LoadBlockIndex() : failed to read block index");
 
-        // LABH: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    size_t nLoaded = 0;
+    BOOST_FOREACH(const vector<CLoadedBlockIndex>& vLoaded, vShards)
+        nLoaded += vLoaded.size();
+    mapBlockIndex.reserve(nLoaded);
+    mapBlockPos.reserve(nLoaded);
 
-        iterator->Next();
+    BOOST_FOREACH(vector<CLoadedBlockIndex>& vLoaded, vShards)
+    {
+        boost::this_thread::interruption_point();
+        BOOST_FOREACH(const CLoadedBlockIndex& loaded, vLoaded)
+        {
+            const CDiskBlockIndex& diskindex = loaded.diskindex;
+            uint256 blockHash = loaded.hash;
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            mapBlockPos[BlockPosKey(pindexNew->nFile, pindexNew->nBlockPos)] = pindexNew;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProof      = diskindex.hashProof;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            // Holds the block's own trust until the chain trust pass below
+            pindexNew->nChainTrust    = loaded.nBlockTrust;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex())
+                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+            // LABH: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
+        vector<CLoadedBlockIndex>().swap(vLoaded);
     }
-    delete iterator;
 
     boost::this_thread::interruption_point();
 
@@ -387,9 +506,15 @@ bool CTxDB::LoadBlockIndex()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->nChainTrust;
     }
 
+    LogPrint("db", "LoadBlockIndex(): loaded %u entries with %u threads\n", nLoaded, nShards);
+
+    // Drop the per-nBits block trust cache written by earlier builds
+    if (!fReadOnly && Exists(string("blocktrustcache")))
+        Erase(string("blocktrustcache"));
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -400,6 +525,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -421,12 +547,18 @@ bool CTxDB::LoadBlockIndex()
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
     CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPosCheck;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
+        // check level 1: verify the stored header hashes to its index key
+        if (nCheckLevel>0 && CDiskBlockIndex(pindex).GetBlockHash() != pindex->GetBlockHash())
+        {
+            LogPrintf("LoadBlockIndex() : *** block index entry at %d does not match its hash %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            pindexFork = pindex->pprev;
+        }
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
@@ -441,7 +573,7 @@ bool CTxDB::LoadBlockIndex()
         if (nCheckLevel>1)
         {
             pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
+            mapBlockPosCheck[pos] = pindex;
             BOOST_FOREACH(const CTransaction &tx, block.vtx)
             {
                 uint256 hashTx = tx.GetHash();
@@ -474,7 +606,7 @@ bool CTxDB::LoadBlockIndex()
                             if (!txpos.IsNull())
                             {
                                 pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
+                                if (!mapBlockPosCheck.count(posFind))
                                 {
                                     LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
                                     pindexFork = pindex->pprev;
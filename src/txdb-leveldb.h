@@ -193,6 +193,9 @@ public:
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadStakeLineage(uint256 hash, CStakeLineage& lineage);
+    bool WriteStakeLineage(uint256 hash, const CStakeLineage& lineage);
+    bool EraseStakeLineage(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
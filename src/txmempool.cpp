@@ -9,8 +9,131 @@
 
 using namespace std;
 
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    ptx = NULL;
+    nFee = 0;
+    nTxSize = 0;
+    nSigOps = 0;
+    nTime = 0;
+    nCountWithAncestors = 0;
+    nSizeWithAncestors = 0;
+    nFeesWithAncestors = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(CAmount nFeeIn, unsigned int nTxSizeIn, unsigned int nSigOpsIn, int64_t nTimeIn,
+                                 const std::vector<CAmount>& vInputValuesIn) :
+    ptx(NULL), nFee(nFeeIn), nTxSize(nTxSizeIn), nSigOps(nSigOpsIn), nTime(nTimeIn), vInputValues(vInputValuesIn)
+{
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = nFee;
+}
+
+CAmount CTxMemPoolEntry::GetValueIn() const
+{
+    CAmount nValueIn = 0;
+    BOOST_FOREACH(CAmount nValue, vInputValues)
+        nValueIn += nValue;
+    return nValueIn;
+}
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+}
+
+void CTxMemPool::CalculateAncestors(const CTransaction& tx, set<uint256>& setAncestors) const
+{
+    vector<const CTransaction*> vStack(1, &tx);
+    while (!vStack.empty())
+    {
+        const CTransaction* ptx = vStack.back();
+        vStack.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin)
+        {
+            map<uint256, CTransaction>::const_iterator mi = mapTx.find(txin.prevout.hash);
+            if (mi != mapTx.end() && setAncestors.insert(mi->first).second)
+                vStack.push_back(&mi->second);
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    vector<uint256> vStack(1, hash);
+    while (!vStack.empty())
+    {
+        uint256 hashTx = vStack.back();
+        vStack.pop_back();
+        map<uint256, CTransaction>::const_iterator mi = mapTx.find(hashTx);
+        if (mi == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < mi->second.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hashTx, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vStack.push_back(hashChild);
+        }
+    }
+}
+
+void CTxMemPool::UpdateAncestorState(const uint256& hash, int64_t nCount, int64_t nSize, CAmount nFees)
+{
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    CTxMemPoolEntry& entry = mi->second;
+    setByAncestorFeeRate.erase(FeeRateKey(entry.GetAncestorFeeRate(), hash));
+    entry.nCountWithAncestors += nCount;
+    entry.nSizeWithAncestors += nSize;
+    entry.nFeesWithAncestors += nFees;
+    setByAncestorFeeRate.insert(FeeRateKey(entry.GetAncestorFeeRate(), hash));
+}
+
+void CTxMemPool::CalculateAncestorState(CTxMemPoolEntry& entry) const
+{
+    entry.nCountWithAncestors = 1;
+    entry.nSizeWithAncestors = entry.nTxSize;
+    entry.nFeesWithAncestors = entry.nFee;
+
+    set<uint256> setAncestors;
+    CalculateAncestors(*entry.ptx, setAncestors);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        const CTxMemPoolEntry& ancestor = mapEntry.find(hashAncestor)->second;
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += ancestor.nTxSize;
+        entry.nFeesWithAncestors += ancestor.nFee;
+    }
+}
+
+void CTxMemPool::GetSortedAncestors(const uint256& hash, vector<const CTxMemPoolEntry*>& vAncestors) const
+{
+    vAncestors.clear();
+    map<uint256, CTransaction>::const_iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return;
+
+    set<uint256> setAncestors;
+    CalculateAncestors(mi->second, setAncestors);
+
+    // An ancestor always has fewer ancestors of its own than any of its descendants
+    vector<pair<uint64_t, const CTxMemPoolEntry*> > vSorted;
+    vSorted.reserve(setAncestors.size());
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        const CTxMemPoolEntry& entry = mapEntry.find(hashAncestor)->second;
+        vSorted.push_back(make_pair(entry.GetCountWithAncestors(), &entry));
+    }
+    sort(vSorted.begin(), vSorted.end());
+
+    vAncestors.reserve(vSorted.size());
+    for (unsigned int i = 0; i < vSorted.size(); i++)
+        vAncestors.push_back(vSorted[i].second);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,7 +148,7 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entryIn)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
@@ -33,14 +156,34 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
     LOCK(cs);
     {
         mapTx[hash] = tx;
+        const CTransaction* ptx = &mapTx[hash];
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(ptx, i);
+
+        CTxMemPoolEntry& entry = mapEntry[hash];
+        entry = entryIn;
+        entry.ptx = ptx;
+        CalculateAncestorState(entry);
+        setByAncestorFeeRate.insert(FeeRateKey(entry.GetAncestorFeeRate(), hash));
+
+        // Transactions put back into the pool on a reorganize may already have
+        // descendants here, which gain this transaction and its ancestors
+        set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        {
+            CTxMemPoolEntry& descendant = mapEntry[hashDescendant];
+            setByAncestorFeeRate.erase(FeeRateKey(descendant.GetAncestorFeeRate(), hashDescendant));
+            CalculateAncestorState(descendant);
+            setByAncestorFeeRate.insert(FeeRateKey(descendant.GetAncestorFeeRate(), hashDescendant));
+        }
+
         nTransactionsUpdated++;
     }
     return true;
 }
 
-bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
+bool CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
@@ -52,11 +195,22 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
                     std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
                     if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
+                        remove(*it->second.ptx, removed, true);
                 }
             }
+
+            // Whatever still depends on it no longer has it as an unconfirmed ancestor
+            const CTxMemPoolEntry& entry = mapEntry[hash];
+            set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                UpdateAncestorState(hashDescendant, -1, -(int64_t)entry.nTxSize, -entry.nFee);
+            setByAncestorFeeRate.erase(FeeRateKey(entry.GetAncestorFeeRate(), hash));
+            mapEntry.erase(hash);
+
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            removed.push_back(tx);
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -64,7 +218,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     return true;
 }
 
-bool CTxMemPool::removeConflicts(const CTransaction &tx)
+bool CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed)
 {
     // Remove transactions which depend on inputs of tx, recursively
     LOCK(cs);
@@ -73,7 +227,7 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
-                remove(txConflict, true);
+                remove(txConflict, removed, true);
         }
     }
     return true;
@@ -84,6 +238,8 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setByAncestorFeeRate.clear();
     ++nTransactionsUpdated;
 }
 
@@ -105,3 +261,12 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     result = i->second;
     return true;
 }
+
+bool CTxMemPool::lookupEntry(uint256 hash, CTxMemPoolEntry& result) const
+{
+    LOCK(cs);
+    std::map<uint256, CTxMemPoolEntry>::const_iterator i = mapEntry.find(hash);
+    if (i == mapEntry.end()) return false;
+    result = i->second;
+    return true;
+}
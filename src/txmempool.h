@@ -5,9 +5,55 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <list>
+
 #include "core.h"
 #include "sync.h"
 
+/** Metadata kept by the memory pool for each transaction it holds.
+ * The ancestor totals cover this transaction and all of its unconfirmed
+ * in-pool ancestors, so a transaction can be ranked by the fee rate of
+ * the package that has to be mined together with it.
+ */
+class CTxMemPoolEntry
+{
+private:
+    const CTransaction* ptx;
+    CAmount nFee;
+    unsigned int nTxSize;
+    unsigned int nSigOps;
+    int64_t nTime;
+    std::vector<CAmount> vInputValues; // value of each spent output, in vin order
+
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nFeesWithAncestors;
+
+public:
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(CAmount nFeeIn, unsigned int nTxSizeIn, unsigned int nSigOpsIn, int64_t nTimeIn,
+                    const std::vector<CAmount>& vInputValuesIn);
+
+    const CTransaction& GetTx() const { return *ptx; }
+    CAmount GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    int64_t GetTime() const { return nTime; }
+    const std::vector<CAmount>& GetInputValues() const { return vInputValues; }
+    CAmount GetValueIn() const;
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetFeesWithAncestors() const { return nFeesWithAncestors; }
+
+    // Fee per kilobyte of this transaction alone
+    double GetFeeRate() const { return double(nFee) / (double(nTxSize) / 1000.0); }
+    // Fee per kilobyte of this transaction together with its in-pool ancestors
+    double GetAncestorFeeRate() const { return double(nFeesWithAncestors) / (double(nSizeWithAncestors) / 1000.0); }
+
+    friend class CTxMemPool;
+};
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -17,22 +63,35 @@
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * Alongside each transaction the pool keeps a CTxMemPoolEntry, and
+ * setByAncestorFeeRate orders all entries by ancestor package fee rate
+ * (ascending), for block assembly to walk from the back.
  */
 class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
 
+    void CalculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void UpdateAncestorState(const uint256& hash, int64_t nCount, int64_t nSize, CAmount nFees);
+    void CalculateAncestorState(CTxMemPoolEntry& entry) const;
+
 public:
+    typedef std::pair<double, uint256> FeeRateKey;
+
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<FeeRateKey> setByAncestorFeeRate;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
-    bool remove(const CTransaction &tx, bool fRecursive = false);
-    bool removeConflicts(const CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry);
+    bool remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
+    bool removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     unsigned int GetTransactionsUpdated() const;
@@ -51,6 +110,10 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    bool lookupEntry(uint256 hash, CTxMemPoolEntry& result) const;
+
+    // In-pool ancestors of a pool transaction, ordered so that parents come before children
+    void GetSortedAncestors(const uint256& hash, std::vector<const CTxMemPoolEntry*>& vAncestors) const;
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
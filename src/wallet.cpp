@@ -14,7 +14,10 @@
 #include "ui_interface.h"
 #include "walletdb.h"
 
+#include <atomic>
+
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -346,29 +349,12 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
-
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
-    }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
-    {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
-    }
-
-    return txOrdered;
+    AssertLockHeld(cs_wallet); // wtxOrdered
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
@@ -420,8 +406,14 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        // Keys may have been added, so rebuild the unspent outputs too
+        setUnspent.clear();
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
             item.second.MarkDirty();
+            AddUnspent(item.second);
+        }
+        fBalancesDirty = true;
     }
 }
 
@@ -439,6 +431,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -450,9 +443,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -537,6 +528,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                 }
             }
         }
+        AddUnspent(wtx);
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx, (wtxIn.hashBlock != 0));
 
@@ -581,6 +574,8 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 }
 
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect) {
+    UpdateStakeCache(tx, fConnect);
+
     if (!fConnect)
     {
         // wallets need to refund inputs when disconnecting coinstake
@@ -595,14 +590,75 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
     AddToWalletIfInvolvingMe(tx, pblock, true);
 }
 
+// Return the cached kernel data of an output, filling the cache from the block index on a miss
+bool CWallet::GetStakeCandidate(const CWalletTx* pcoin, unsigned int n, CStakeCandidate& candidate)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    COutPoint prevout(pcoin->GetHash(), n);
+    map<COutPoint, CStakeCandidate>::const_iterator it = mapStakeCache.find(prevout);
+    if (it != mapStakeCache.end())
+    {
+        const CStakeCandidate& cached = it->second;
+        if (cached.pindexFrom->IsInMainChain() && cached.pindexFrom->GetBlockHash() == pcoin->hashBlock)
+        {
+            candidate = cached;
+            return true;
+        }
+        mapStakeCache.erase(prevout);
+    }
+
+    BlockMap::iterator mi = mapBlockIndex.find(pcoin->hashBlock);
+    if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+        return false;
+
+    candidate = CStakeCandidate(prevout, pcoin->vout[n].nValue, pcoin->nTime, mi->second);
+    mapStakeCache[prevout] = candidate;
+    return true;
+}
+
+void CWallet::UpdateStakeCache(const CTransaction& tx, bool fConnect)
+{
+    LOCK(cs_wallet);
+    if (mapStakeCache.empty())
+        return;
+
+    // Spent inputs can no longer stake
+    if (fConnect)
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapStakeCache.erase(txin.prevout);
+    }
+
+    // Outputs of a (dis)connected transaction moved to another block, or out of the chain
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        mapStakeCache.erase(COutPoint(hash, i));
+}
+
 void CWallet::EraseFromWallet(const uint256 &hash)
 {
     if (!fFileBacked)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(mi->second.nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it)
+            {
+                if (it->second.first == &mi->second)
+                {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            }
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        fBalancesDirty = true;
     }
     return;
 }
@@ -862,6 +918,63 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Rescan pipeline: blocks are read and their outputs matched against the
+// wallet keys on reader threads, without cs_main or cs_wallet, one batch
+// ahead of the thread that applies the hits under the locks.
+static const unsigned int RESCAN_BATCH_SIZE = 256;
+static const int MAX_RESCAN_THREADS = 16;
+
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    std::vector<unsigned int> vMatched; // positions in block.vtx with an output we own
+};
+
+static void ThreadRescanRead(const CWallet* pwallet, std::vector<CRescanBlock>* pvBlocks, std::atomic<unsigned int>* pnNext)
+{
+    unsigned int i;
+    while ((i = (*pnNext)++) < pvBlocks->size())
+    {
+        CRescanBlock& item = (*pvBlocks)[i];
+        item.fRead = item.block.ReadFromDisk(item.pindex, true);
+        if (!item.fRead)
+            continue;
+        for (unsigned int n = 0; n < item.block.vtx.size(); n++)
+        {
+            BOOST_FOREACH(const CTxOut& txout, item.block.vtx[n].vout)
+            {
+                if (pwallet->IsMine(txout))
+                {
+                    item.vMatched.push_back(n);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void ReadRescanBatch(const CWallet* pwallet, std::vector<CRescanBlock>* pvBlocks, int nThreads)
+{
+    std::atomic<unsigned int> nNext(0);
+    boost::thread_group readers;
+    for (int i = 0; i < nThreads; i++)
+        readers.create_thread(boost::bind(&ThreadRescanRead, pwallet, pvBlocks, &nNext));
+    readers.join_all();
+}
+
+static void NextRescanBatch(const std::vector<CBlockIndex*>& vScan, unsigned int& nPos, std::vector<CRescanBlock>& vBatch)
+{
+    vBatch.clear();
+    vBatch.resize(std::min((size_t)RESCAN_BATCH_SIZE, vScan.size() - nPos));
+    for (unsigned int i = 0; i < vBatch.size(); i++)
+    {
+        vBatch[i].pindex = vScan[nPos++];
+        vBatch[i].fRead = false;
+    }
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
@@ -869,31 +982,107 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    std::vector<CBlockIndex*> vScan;
     {
         LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
         {
             // no need to read and scan block, if block was created before
             // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
+            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
                 continue;
-            }
+            vScan.push_back(pindex);
+        }
+    }
+
+    int nThreads = GetArg("-rescanthreads", 0);
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+
+    {
+        LOCK(cs_rescan);
+        rescanProgress = CRescanProgress();
+        rescanProgress.fActive = true;
+        rescanProgress.nStartHeight = vScan.empty() ? 0 : vScan.front()->nHeight;
+        rescanProgress.nStopHeight = vScan.empty() ? 0 : vScan.back()->nHeight;
+        rescanProgress.nHeight = rescanProgress.nStartHeight;
+        rescanProgress.nBlocksTotal = vScan.size();
+        rescanProgress.nStartTime = rescanProgress.nUpdateTime = GetTimeMillis();
+    }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+    unsigned int nPos = 0;
+    std::vector<CRescanBlock> vCurrent, vNext;
+    NextRescanBatch(vScan, nPos, vCurrent);
+    ReadRescanBatch(this, &vCurrent, nThreads);
+    while (!vCurrent.empty())
+    {
+        // Read the next batch while the hits of this one are applied
+        NextRescanBatch(vScan, nPos, vNext);
+        boost::thread prefetch(boost::bind(&ReadRescanBatch, this, &vNext, nThreads));
+        try
+        {
+            BOOST_FOREACH(CRescanBlock& item, vCurrent)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                {
+                    LOCK2(cs_main, cs_wallet);
+                    // skip blocks a reorganize took out of the chain since they were listed
+                    if (item.fRead && item.pindex->IsInMainChain())
+                    {
+                        std::vector<unsigned int>::const_iterator itMatch = item.vMatched.begin();
+                        for (unsigned int n = 0; n < item.block.vtx.size(); n++)
+                        {
+                            const CTransaction& tx = item.block.vtx[n];
+                            bool fInvolved = (itMatch != item.vMatched.end() && *itMatch == n);
+                            if (fInvolved)
+                                ++itMatch;
+                            // Only outputs were matched ahead; a transaction we already
+                            // have, or one spending our coins (including coins found
+                            // earlier in this scan), is found through mapWallet
+                            else
+                                fInvolved = mapWallet.count(tx.GetHash());
+                            for (unsigned int i = 0; !fInvolved && i < tx.vin.size(); i++)
+                                fInvolved = mapWallet.count(tx.vin[i].prevout.hash);
+                            if (!fInvolved)
+                                continue;
+                            if (AddToWalletIfInvolvingMe(tx, &item.block, fUpdate))
+                                ret++;
+                        }
+                    }
+                }
+
+                LOCK(cs_rescan);
+                rescanProgress.nHeight = item.pindex->nHeight;
+                rescanProgress.nBlocksDone++;
+                rescanProgress.nFound = ret;
+                rescanProgress.nUpdateTime = GetTimeMillis();
             }
-            pindex = pindex->pnext;
         }
+        catch (...)
+        {
+            prefetch.join();
+            LOCK(cs_rescan);
+            rescanProgress.fActive = false;
+            throw;
+        }
+        prefetch.join();
+        vCurrent.swap(vNext);
+    }
+
+    {
+        LOCK(cs_rescan);
+        rescanProgress.fActive = false;
+        rescanProgress.nUpdateTime = GetTimeMillis();
     }
     return ret;
 }
 
+CRescanProgress CWallet::GetRescanProgress() const
+{
+    LOCK(cs_rescan);
+    return rescanProgress;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     CTxDB txdb("r");
@@ -1039,50 +1228,125 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-CAmount CWallet::GetBalance() const
+// Record the unspent outputs of ours in wtx
+void CWallet::AddUnspent(const CWalletTx& wtx)
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
+    AssertLockHeld(cs_wallet);
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            setUnspent.insert(COutPoint(hash, i));
+    fBalancesDirty = true;
+}
 
-    return nTotal;
+// Called by CWalletTx whenever the spent flag of one of its outputs changes
+void CWallet::UpdateUnspent(const COutPoint& outpoint, bool fSpent) const
+{
+    LOCK(cs_wallet);
+    if (!fSpent)
+        setUnspent.insert(outpoint);
+    fBalancesDirty = true;
 }
 
-CAmount CWallet::GetUnconfirmedBalance() const
+// Walk setUnspent one transaction at a time, dropping the outputs that have
+// been spent or erased since they were recorded. Returns NULL at the end.
+const CWalletTx* CWallet::NextUnspentTx(set<COutPoint>::const_iterator& it, vector<unsigned int>& vOut) const
 {
-    CAmount nTotal = 0;
+    AssertLockHeld(cs_wallet);
+    while (it != setUnspent.end())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        uint256 hash = it->hash;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        vOut.clear();
+        while (it != setUnspent.end() && it->hash == hash)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
+            if (mi != mapWallet.end() && it->n < mi->second.vout.size() && !mi->second.IsSpent(it->n))
+            {
+                vOut.push_back(it->n);
+                ++it;
+            }
+            else
+                setUnspent.erase(it++);
         }
+        if (!vOut.empty())
+            return &mi->second;
     }
-    return nTotal;
+    return NULL;
 }
 
-CAmount CWallet::GetImmatureBalance() const
+void CWallet::UpdateBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // Finality of an unconfirmed transaction also depends on the clock
+    if (!fBalancesDirty && !fBalancesHaveNonFinal && pindexBalances == pindexBest)
+        return;
+
+    CWalletBalances balances;
+    bool fHaveNonFinal = false;
+    vStakeableCached.clear();
+    vector<unsigned int> vOut;
+    set<COutPoint>::const_iterator it = setUnspent.begin();
+    while (const CWalletTx* pcoin = NextUnspentTx(it, vOut))
+    {
+        bool fFinal = IsFinalTx(*pcoin);
+        bool fTrusted = pcoin->IsTrusted();
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (!fFinal)
+            fHaveNonFinal = true;
+
+        if (fTrusted)
+            balances.nTrusted += pcoin->GetAvailableCredit();
+        if (!fFinal || (!fTrusted && nDepth == 0))
+            balances.nUnconfirmed += pcoin->GetAvailableCredit();
+
+        if (pcoin->GetBlocksToMaturity() > 0)
         {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
+            if (nDepth > 0 && pcoin->IsCoinBase())
+                balances.nImmature += GetCredit(*pcoin);
+            else if (nDepth > 0 && pcoin->IsCoinStake())
+                balances.nStake += GetCredit(*pcoin);
+        }
+        else if (nDepth >= 1 && nDepth >= nStakeMinConfirmations)
+        {
+            BOOST_FOREACH(unsigned int n, vOut)
+            {
+                if (pcoin->vout[n].nValue >= nMinimumInputValue)
+                {
+                    balances.nStakeable += pcoin->vout[n].nValue;
+                    vStakeableCached.push_back(make_pair(pcoin, n));
+                }
+            }
         }
     }
-    return nTotal;
+
+    balancesCached = balances;
+    fBalancesDirty = false;
+    fBalancesHaveNonFinal = fHaveNonFinal;
+    pindexBalances = pindexBest;
+}
+
+CWalletBalances CWallet::GetBalances() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balancesCached;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nTrusted;
+}
+
+CAmount CWallet::GetUnconfirmedBalance() const
+{
+    return GetBalances().nUnconfirmed;
+}
+
+CAmount CWallet::GetImmatureBalance() const
+{
+    return GetBalances().nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1092,10 +1356,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<unsigned int> vOut;
+        set<COutPoint>::const_iterator it = setUnspent.begin();
+        while (const CWalletTx* pcoin = NextUnspentTx(it, vOut))
         {
-            const CWalletTx* pcoin = &(*it).second;
-
             if (!IsFinalTx(*pcoin))
                 continue;
 
@@ -1112,9 +1376,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             if (nDepth < 0)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+            BOOST_FOREACH(unsigned int i, vOut)
+                if (pcoin->vout[i].nValue >= nMinimumInputValue &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(pcoin->GetHash(), i)))
                     vCoins.push_back(COutput(pcoin, i, nDepth));
 
         }
@@ -1127,10 +1391,10 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<unsigned int> vOut;
+        set<COutPoint>::const_iterator it = setUnspent.begin();
+        while (const CWalletTx* pcoin = NextUnspentTx(it, vOut))
         {
-            const CWalletTx* pcoin = &(*it).second;
-
             // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
             if (pcoin->nTime + nStakeMinAge > nSpendTime)
                 continue;
@@ -1145,9 +1409,8 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
             if (pcoin->GetBlocksToMaturity() > 0)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
-                    pcoin->vout[i].nValue >= nMinimumInputValue &&
+            BOOST_FOREACH(unsigned int i, vOut)
+                if (pcoin->vout[i].nValue >= nMinimumInputValue &&
                     (!IlIII(nBestHeight+1) || (IlIII(nBestHeight+1) && pcoin->lIIII(nBestHeight+1)))) {
                         LogPrint("stake", "%s(): added coin=%s", __func__, pcoin->ToString());
                         vCoins.push_back(COutput(pcoin, i, nDepth));
@@ -1205,28 +1468,12 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 CAmount CWallet::GetStake() const
 {
-    CAmount nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nStake;
 }
 
 CAmount CWallet::GetNewMint() const
 {
-    CAmount nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 bool CWallet::SelectCoinsMinConf(CAmount nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
@@ -1563,57 +1810,198 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, CAmount nValue, CWalletTx&
     return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet, 1, coinControl);
 }
 
+// CBigNum(nValue) * nTimeWeight / COIN / (24 * 60 * 60) without the bignum:
+// splitting nValue at COIN keeps both products within 64 bits
+static CAmount GetCoinDayWeight(CAmount nValue, int64_t nTimeWeight)
+{
+    CAmount nCoinSeconds = (nValue / COIN) * nTimeWeight + (nValue % COIN) * nTimeWeight / COIN;
+    return nCoinSeconds / (24 * 60 * 60);
+}
+
+// Weight of the coins SelectCoinsForStaking would choose, taken from the
+// cached stakeable outputs without reading the tx index
 bool CWallet::GetStakeWeight(CAmount& nMinWeight, CAmount& nMaxWeight, CAmount& nWeight)
 {
-    // Choose coins to use
-    CAmount nBalance = GetBalance();
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
 
+    CAmount nBalance = balancesCached.nTrusted;
     if (nBalance <= nReserveBalance)
         return false;
 
-    vector<const CWalletTx*> vwtxPrev;
-
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    CAmount nTargetValue = nBalance - nReserveBalance;
     CAmount nValueIn = 0;
-
-    if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
-        return false;
-
-    if (setCoins.empty())
-        return false;
-
+    bool fSelected = false;
     int64_t nCurrentTime = GetTime();
-    CTxDB txdb("r");
+    bool fSuperblock = IlIII(nBestHeight+1);
 
-    LOCK2(cs_main, cs_wallet);
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& coin, vStakeableCached)
     {
-        CTxIndex txindex;
-        if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
+        const CWalletTx* pcoin = coin.first;
+
+        // Filters of AvailableCoinsForStaking that depend on the time or the next block
+        if (pcoin->nTime + nStakeMinAge > nCurrentTime)
+            continue;
+        if (fSuperblock && !pcoin->lIIII(nBestHeight+1))
             continue;
 
-        if (nCurrentTime - pcoin.first->nTime > nStakeMinAge)
-            nWeight += pcoin.first->vout[pcoin.second].nValue;
+        // Stop if we've chosen enough inputs
+        if (nValueIn >= nTargetValue)
+            break;
+
+        CAmount nValue = pcoin->vout[coin.second].nValue;
+        nValueIn += nValue;
+        fSelected = true;
+
+        if (nCurrentTime - pcoin->nTime > nStakeMinAge)
+            nWeight += nValue;
 
         if (nBestHeight >= 25000) {
-            int64_t nTimeWeight = GetWeight((int64_t)pcoin.first->nTime, (int64_t)GetTime());
-            CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+            int64_t nTimeWeight = GetWeight((int64_t)pcoin->nTime, nCurrentTime);
+            CAmount nCoinDayWeight = GetCoinDayWeight(nValue, nTimeWeight);
 
             // Weight is greater than zero, but the maximum value isn't reached yet
             if (nTimeWeight && nTimeWeight < nStakeMaxAge)
-                nMinWeight += bnCoinDayWeight.getuint64();
+                nMinWeight += nCoinDayWeight;
 
             // Maximum weight was reached
             if (nTimeWeight == nStakeMaxAge)
-                nMaxWeight += bnCoinDayWeight.getuint64();
+                nMaxWeight += nCoinDayWeight;
         } else {
             nMinWeight = nWeight;
         }
+
+        if (nValue >= nTargetValue)
+            break;
+    }
+
+    return fSelected;
+}
+
+static const int MAX_STAKE_THREADS = 16;
+
+static CCriticalSection cs_stakeSearch;
+static CStakeSearchStats stakeSearchStats = { 0, 0, 0, 0, 0 };
+
+CStakeSearchStats GetStakeSearchStats()
+{
+    LOCK(cs_stakeSearch);
+    return stakeSearchStats;
+}
+
+// Key and coinstake output script for a kernel; only pay to public key and
+// pay to address kernels are supported
+static bool GetKernelKey(const CKeyStore& keystore, const CScript& scriptPubKeyKernel, CKey& key, CScript& scriptPubKeyOut)
+{
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+    {
+        LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+        return false;
+    }
+    LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+    if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+    {
+        LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+        return false;  // only support pay to public key and pay to address
+    }
+    if (whichType == TX_PUBKEYHASH) // pay to address type
+    {
+        // convert to pay to public key type
+        if (!keystore.GetKey(uint160(vSolutions[0]), key))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
+        scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
     }
+    if (whichType == TX_PUBKEY)
+    {
+        valtype& vchPubKey = vSolutions[0];
+        if (!keystore.GetKey(Hash160(vchPubKey), key))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
 
+        if (key.GetPubKey() != vchPubKey)
+        {
+            LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+            return false; // keys mismatch
+        }
+
+        scriptPubKeyOut = scriptPubKeyKernel;
+    }
+
+    LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
     return true;
 }
 
+typedef pair<pair<const CWalletTx*, unsigned int>, CStakeCandidate> StakeCoin;
+
+// One round of the kernel search. The round parameters are fixed before the
+// search threads start; the first thread to find a usable kernel fills in
+// the result and the others stop.
+struct CStakeSearch
+{
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    int64_t nTime;                       // newest timestamp tried
+    unsigned int nInterval;              // timestamps tried, back from nTime
+    const CKeyStore* pkeystore;
+    const vector<StakeCoin>* pvCoins;
+
+    std::atomic<bool> fFound;
+    CCriticalSection cs;
+    unsigned int nCoin;                  // index in *pvCoins
+    unsigned int nOffset;                // found at nTime - nOffset
+    CKey key;
+    CScript scriptPubKeyOut;
+};
+
+// Search the coins nThread, nThread + nThreads, ... of the round
+static void SearchStakeKernels(CStakeSearch* psearch, unsigned int nThread, unsigned int nThreads)
+{
+    if (nThreads > 1)
+        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+    const vector<StakeCoin>& vCoins = *psearch->pvCoins;
+    for (unsigned int i = nThread; i < vCoins.size() && !psearch->fFound; i += nThreads)
+    {
+        const CStakeCandidate& candidate = vCoins[i].second;
+        CStakeKernelHasher hasher(psearch->pindexPrev->nStakeModifier, psearch->nBits, candidate.nTimeTx, candidate.nValue, candidate.prevout);
+
+        for (unsigned int n = 0; n < psearch->nInterval && !psearch->fFound && psearch->pindexPrev == pindexBest; n++)
+        {
+            boost::this_thread::interruption_point();
+            // Search backward in time from the given txNew timestamp
+            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+            if (!CheckKernel(psearch->pindexPrev, psearch->nTime - n, candidate, hasher))
+                continue;
+
+            // Found a kernel
+            LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+            const CWalletTx* pcoin = vCoins[i].first.first;
+            CKey key;
+            CScript scriptPubKeyOut;
+            if (!GetKernelKey(*psearch->pkeystore, pcoin->vout[vCoins[i].first.second].scriptPubKey, key, scriptPubKeyOut))
+                break;
+
+            LOCK(psearch->cs);
+            if (!psearch->fFound)
+            {
+                psearch->nCoin = i;
+                psearch->nOffset = n;
+                psearch->key = key;
+                psearch->scriptPubKeyOut = scriptPubKeyOut;
+                psearch->fFound = true;
+            }
+            return;
+        }
+    }
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CAmount nFees, CTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
@@ -1646,90 +2034,79 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
-    CAmount nCredit = 0;
-    CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    // Resolve the kernel inputs up front, so the search below only hashes
+    vector<StakeCoin> vCoins;
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        LOCK2(cs_main, cs_wallet);
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
+            CStakeCandidate candidate;
+            if (GetStakeCandidate(pcoin.first, pcoin.second, candidate))
+                vCoins.push_back(make_pair(pcoin, candidate));
+        }
+    }
 
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+    static int nMaxStakeSearchInterval = 60;
+    CStakeSearch search;
+    search.pindexPrev = pindexPrev;
+    search.nBits = nBits;
+    search.nTime = txNew.nTime;
+    search.nInterval = min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+    search.pkeystore = &keystore;
+    search.pvCoins = &vCoins;
+    search.fFound = false;
+
+    // Split the coins between -stakethreads search threads
+    int nThreads = GetArg("-stakethreads", 1);
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    nThreads = max(1, min(min(nThreads, MAX_STAKE_THREADS), (int)vCoins.size()));
+
+    int64_t nSearchStart = GetTimeMicros();
+    if (nThreads == 1)
+        SearchStakeKernels(&search, 0, 1);
+    else
+    {
+        boost::thread_group searchers;
+        for (int i = 0; i < nThreads; i++)
+            searchers.create_thread(boost::bind(&SearchStakeKernels, &search, i, nThreads));
+        try
+        {
+            searchers.join_all();
+        }
+        catch (boost::thread_interrupted&)
+        {
+            // the searchers use this frame's data, let them finish first
+            searchers.interrupt_all();
+            searchers.join_all();
+            throw;
+        }
+    }
+    int64_t nSearchTime = GetTimeMicros() - nSearchStart;
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+    {
+        LOCK(cs_stakeSearch);
+        stakeSearchStats.nRounds++;
+        stakeSearchStats.nThreads = nThreads;
+        stakeSearchStats.nCoins = vCoins.size();
+        stakeSearchStats.nLastRoundTime = nSearchTime;
+        stakeSearchStats.nTotalRoundTime += nSearchTime;
+    }
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-
-                // Calculate the total size of our new output including the stake reward
-                // and decide whether to split the stake outputs
-                CAmount nCoinAge;
-                CTxDB txdb("r");
-                const CBlockIndex* pIndex0 = GetLastBlockIndex(pindexBest, false);
-                if (!txNew.GetCoinAge(txdb, pindexBest, nCoinAge))
-                    return error("CreateCoinStake : failed to calculate coin age");
-                CAmount nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetProofOfStakeReward(pIndex0, nCoinAge, nFees);
-
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            }
-        }
+    CAmount nCredit = 0;
+    CScript scriptPubKeyKernel;
+    if (search.fFound)
+    {
+        const CWalletTx* pcoin = vCoins[search.nCoin].first.first;
+        unsigned int nOut = vCoins[search.nCoin].first.second;
+        key = search.key;
+        scriptPubKeyKernel = pcoin->vout[nOut].scriptPubKey;
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime -= search.nOffset;
+        txNew.vin.push_back(CTxIn(pcoin->GetHash(), nOut));
+        nCredit += pcoin->vout[nOut].nValue;
+        vwtxPrev.push_back(pcoin);
+        txNew.vout.push_back(CTxOut(0, search.scriptPubKeyOut));
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -1813,8 +2190,7 @@ bool CWallet::GetStakeWeightFromValue(const int64_t& nTime, const CAmount& nValu
     if (nTimeWeight < 0)
         nTimeWeight = 0;
 
-    CBigNum bnCoinDayWeight = CBigNum(nValue) * nTimeWeight / COIN / (24 * 60 * 60);
-    nWeight = bnCoinDayWeight.getuint64();
+    nWeight = GetCoinDayWeight(nValue, nTimeWeight);
     return true;
 }
 
@@ -1947,6 +2323,20 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        // Activity log, from the transactions and accounting entries as reordered by the load
+        LOCK(cs_wallet);
+        laccentries.clear();
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+        wtxOrdered.clear();
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            wtxOrdered.insert(make_pair(item.second.nOrderPos, TxPair(&item.second, (CAccountingEntry*)0)));
+        BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+            wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    }
+
+    MarkDirty();
+
     return DB_LOAD_OK;
 }
 
@@ -2405,7 +2795,11 @@ void CWallet::UpdatedTransaction(const uint256 &hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end())
+        {
+            // Depth and trust of unconfirmed transactions follow mempool membership
+            fBalancesDirty = true;
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
+        }
     }
 }
 
@@ -2438,7 +2832,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 
 #include "crypter.h"
+#include "kernel.h"
 #include "main.h"
 #include "key.h"
 #include "keystore.h"
@@ -34,6 +35,64 @@ class CReserveKey;
 class COutput;
 class CWalletDB;
 
+/** Wallet balances by bucket, recomputed from the unspent outputs only when
+ * the wallet or the best chain has changed since they were last computed.
+ */
+class CWalletBalances
+{
+public:
+    CAmount nTrusted;      // GetBalance
+    CAmount nUnconfirmed;  // GetUnconfirmedBalance
+    CAmount nImmature;     // immature coinbase: GetImmatureBalance, GetNewMint
+    CAmount nStake;        // immature coinstake: GetStake
+    CAmount nStakeable;    // mature outputs with enough confirmations to stake
+
+    CWalletBalances()
+    {
+        nTrusted = 0;
+        nUnconfirmed = 0;
+        nImmature = 0;
+        nStake = 0;
+        nStakeable = 0;
+    }
+};
+
+/** Progress of the running (or last) wallet rescan, reported by getrescaninfo */
+class CRescanProgress
+{
+public:
+    bool fActive;
+    int nStartHeight;
+    int nStopHeight;
+    int nHeight;
+    int nBlocksDone;
+    int nBlocksTotal;
+    int nFound;
+    int64_t nStartTime;   // milliseconds
+    int64_t nUpdateTime;  // milliseconds
+
+    CRescanProgress()
+    {
+        fActive = false;
+        nStartHeight = 0;
+        nStopHeight = 0;
+        nHeight = 0;
+        nBlocksDone = 0;
+        nBlocksTotal = 0;
+        nFound = 0;
+        nStartTime = 0;
+        nUpdateTime = 0;
+    }
+
+    // Milliseconds left at the rate seen so far, -1 if unknown
+    int64_t GetETA() const
+    {
+        if (nBlocksDone == 0)
+            return -1;
+        return (nUpdateTime - nStartTime) * (nBlocksTotal - nBlocksDone) / nBlocksDone;
+    }
+};
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -72,6 +131,18 @@ public:
     )
 };
 
+/** Timing of the proof-of-stake kernel search rounds */
+struct CStakeSearchStats
+{
+    uint64_t nRounds;
+    int nThreads;             // threads used by the last round
+    unsigned int nCoins;      // candidates searched by the last round
+    int64_t nLastRoundTime;   // microseconds
+    int64_t nTotalRoundTime;  // microseconds
+};
+
+CStakeSearchStats GetStakeSearchStats();
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -89,6 +160,22 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Protects rescanProgress only; never held while taking another lock
+    mutable CCriticalSection cs_rescan;
+    CRescanProgress rescanProgress;
+
+    // Cached balances, valid while none of these has changed
+    mutable CWalletBalances balancesCached;
+    mutable bool fBalancesDirty;
+    mutable bool fBalancesHaveNonFinal;
+    mutable const CBlockIndex* pindexBalances;
+    // Outputs counted in nStakeable, in the order the stake thread selects them
+    mutable std::vector<std::pair<const CWalletTx*, unsigned int> > vStakeableCached;
+
+    const CWalletTx* NextUnspentTx(std::set<COutPoint>::const_iterator& it, std::vector<unsigned int>& vOut) const;
+    void AddUnspent(const CWalletTx& wtx);
+    void UpdateBalances() const;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -135,10 +222,20 @@ public:
         nTimeFirstKey = 0;
         fSplitBlock = false;
         lastOrderId = "";
+        fBalancesDirty = true;
+        fBalancesHaveNonFinal = false;
+        pindexBalances = NULL;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
     int64_t nOrderPosNext;
+
+    // Outputs of ours that were unspent when last seen. Outputs spent since
+    // are dropped lazily by the coin and balance queries, so this may hold more.
+    mutable std::set<COutPoint> setUnspent;
+
+    // Kernel inputs of our stakeable outputs, so the stake search does not hit the disk
+    std::map<COutPoint, CStakeCandidate> mapStakeCache;
     std::map<uint256, int> mapRequestCount;
 
     std::map<CTxDestination, std::string> mapAddressBook;
@@ -152,6 +249,8 @@ public:
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
     bool SelectCoinsMinConf(CAmount nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool GetStakeCandidate(const CWalletTx* pcoin, unsigned int n, CStakeCandidate& candidate);
+    void UpdateStakeCache(const CTransaction& tx, bool fConnect);
 
     // keystore implementation
     // Generate a new key
@@ -187,11 +286,14 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    /** The wallet's activity log: transactions and accounting entries by nOrderPos.
+        Built once in LoadWallet and kept up to date by AddToWallet, EraseFromWallet
+        and AddAccountingEntry; protected by cs_wallet. */
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
+    /** Add an accounting entry already committed to the wallet database to the activity log */
+    void AddAccountingEntry(const CAccountingEntry& acentry);
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
@@ -200,8 +302,11 @@ public:
     void EraseFromWallet(const uint256 &hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    CRescanProgress GetRescanProgress() const;
+    void UpdateUnspent(const COutPoint& outpoint, bool fSpent) const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
+    CWalletBalances GetBalances() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
@@ -537,6 +642,8 @@ public:
                 vfSpent[i] = true;
                 fReturn = true;
                 fAvailableCreditCached = false;
+                if (pwallet)
+                    pwallet->UpdateUnspent(COutPoint(GetHash(), i), true);
             }
         }
         return fReturn;
@@ -566,6 +673,8 @@ public:
         {
             vfSpent[nOut] = true;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->UpdateUnspent(COutPoint(GetHash(), nOut), true);
         }
     }
 
@@ -578,6 +687,8 @@ public:
         {
             vfSpent[nOut] = false;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->UpdateUnspent(COutPoint(GetHash(), nOut), false);
         }
     }
 